@@ -0,0 +1,1156 @@
+// benchmarks for the lstm library
+// build and run with: make bench && ./build/bench
+// for the AVX2 kernels build with: make bench BENCH_CFLAGS="-g -O2 -march=native"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "lstm.h"
+#include "lstmf.h"
+#include "nutils.h"
+#include "vmath.h"
+#include "backprop.h"
+#include "trainer.h"
+#include "optimizer.h"
+#include "scheduler.h"
+#include "stacked.h"
+#include "bidir.h"
+#include "instrument.h"
+#include "lstm_fixed.h"
+#include "lstmq.h"
+#include "sparse.h"
+
+// counting allocator for the alloc section: the bench defines malloc, calloc and realloc itself, so every call of the library (and of gsl inside it) goes through these.
+// glibc exports its own allocator as __libc_malloc, __libc_calloc and __libc_realloc. with another C library the wrappers aren't built and the section is skipped
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static int alloc_counting = 0; // only set around the measured loop of the alloc section, which runs on the main thread alone
+static long alloc_calls = 0;
+
+void *malloc(size_t size) {
+	if (alloc_counting) alloc_calls++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	if (alloc_counting) alloc_calls++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) {
+	if (alloc_counting) alloc_calls++;
+	return __libc_realloc(p, size);
+}
+#endif
+
+// time in seconds from a monotonic clock
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the scalar activation loops the library used before vmath, kept here as the baseline
+static void libm_sigmoid_vector(gsl_vector *v, gsl_vector *r) {
+	for (int i = 0; i < (int)v->size; i++) gsl_vector_set(r, i, 1 / (1 + exp(-gsl_vector_get(v, i))));
+}
+
+static void libm_tanh_vector(gsl_vector *v, gsl_vector *r) {
+	for (int i = 0; i < (int)v->size; i++) gsl_vector_set(r, i, tanh(gsl_vector_get(v, i)));
+}
+
+static void libm_sech_vector(gsl_vector *v, gsl_vector *r) {
+	for (int i = 0; i < (int)v->size; i++) gsl_vector_set(r, i, 1 / cosh(gsl_vector_get(v, i)));
+}
+
+// ns per element of f(v, r), repeated until at least 0.1s has passed
+static double time_activation(void (*f)(gsl_vector *, gsl_vector *), gsl_vector *v, gsl_vector *r) {
+	long reps = 0;
+	double start = now_sec();
+	double elapsed = 0;
+
+	while (elapsed < 0.1) {
+		for (int k = 0; k < 16; k++) f(v, r);
+		reps += 16;
+		elapsed = now_sec() - start;
+	}
+
+	return elapsed * 1e9 / (reps * (double)v->size);
+}
+
+static void bench_activations() {
+	printf("== activations (kernels compiled for %s) ==\n", vm_isa());
+	printf("%-8s %8s %12s %12s %8s\n", "func", "n", "libm ns/el", "vmath ns/el", "speedup");
+
+	const char *names[3] = {"sigmoid", "tanh", "sech"};
+	void (*ref[3])(gsl_vector *, gsl_vector *) = {libm_sigmoid_vector, libm_tanh_vector, libm_sech_vector};
+	void (*vec[3])(gsl_vector *, gsl_vector *) = {sigmoid_vector, tanh_vector, sech_vector};
+	int sizes[4] = {16, 256, 4096, 65536};
+
+	for (int s = 0; s < 4; s++) {
+		gsl_vector *v = create_rand_vector(sizes[s], -8, 8);
+		gsl_vector *r = gsl_vector_calloc(sizes[s]);
+
+		for (int f = 0; f < 3; f++) {
+			double t_ref = time_activation(ref[f], v, r);
+			double t_vec = time_activation(vec[f], v, r);
+			printf("%-8s %8d %12.2f %12.2f %7.2fx\n", names[f], sizes[s], t_ref, t_vec, t_ref / t_vec);
+		}
+
+		gsl_vector_free(v);
+		gsl_vector_free(r);
+	}
+	printf("\n");
+}
+
+// full tape vs checkpointed bptt on one long series, activation memory is what the tape/checkpoints take (the weights and gradients are the same for every k)
+static void bench_checkpoint() {
+	int input_dim = 4, hidden_dim = 32, output_dim = 4;
+	int n = 16385; // 16384 timesteps + the last target
+
+	printf("== checkpointed bptt (T = %d, hidden_dim = %d) ==\n", n - 1, hidden_dim);
+	printf("%-8s %8s %14s %10s %10s\n", "mode", "k", "memory KiB", "time ms", "time x");
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.5, 0.5, -0.5, 0.5);
+	gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+	BCKPROP_CXT *cxt = bp_create_cxt(lstm);
+
+	double start = now_sec();
+	bp_gradients_lstm(lstm, series, n, cxt);
+	double t_full = now_sec() - start;
+	printf("%-8s %8d %14.1f %10.2f %9.2fx\n", "tape", n - 1, bp_tape_size(lstm, n - 1) / 1024.0, t_full * 1e3, 1.0);
+
+	int ks[5] = {16, bp_ckpt_interval(n - 1), 512, 2048, 8192};
+	for (int j = 0; j < 5; j++) {
+		start = now_sec();
+		bp_gradients_ckpt_lstm(lstm, series, n, ks[j], cxt);
+		double t = now_sec() - start;
+		printf("%-8s %8d %14.1f %10.2f %9.2fx\n", "ckpt", ks[j], bp_ckpt_size(lstm, n - 1, ks[j]) / 1024.0, t * 1e3, t / t_full);
+	}
+
+	bp_delete_cxt(cxt);
+	free_lstm(lstm);
+	free_series_vectors(series, n);
+	printf("\n");
+}
+
+// data parallel training throughput, series per second against the number of threads (up to the number of online cores)
+static void bench_parallel() {
+	int input_dim = 8, hidden_dim = 64, output_dim = 8;
+	int size = 64, n = 65; // 64 series of 64 timesteps per batch
+	int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("== data parallel training (batch = %d series x %d timesteps, hidden_dim = %d, %d cores) ==\n", size, n - 1, hidden_dim, cores);
+	printf("%8s %14s %10s %12s\n", "threads", "series/s", "speedup", "efficiency");
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.5, 0.5, -0.5, 0.5);
+	gsl_vector ***batch = (gsl_vector ***)malloc(size * sizeof(gsl_vector **));
+	for (int b = 0; b < size; b++) batch[b] = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+	double base = 0;
+	for (int threads = 1; threads <= cores; threads *= 2) {
+		TRAINER *trainer = create_trainer(lstm, threads);
+		train_batch(trainer, batch, size, n); // warmup, the workers allocate their tapes here
+
+		long batches = 0;
+		double start = now_sec();
+		double elapsed = 0;
+		while (elapsed < 0.5) {
+			train_batch(trainer, batch, size, n);
+			batches++;
+			elapsed = now_sec() - start;
+		}
+
+		double rate = batches * size / elapsed;
+		if (threads == 1) base = rate;
+		printf("%8d %14.1f %9.2fx %11.0f%%\n", threads, rate, rate / base, 100 * rate / (base * threads));
+
+		free_trainer(trainer);
+		if (threads < cores && threads * 2 > cores) threads = cores / 2; // always finish with every core
+	}
+
+	for (int b = 0; b < size; b++) free_series_vectors(batch[b], n);
+	free(batch);
+	free_lstm(lstm);
+	printf("\n");
+}
+
+// hogwild against the synchronous trainer on a small model: throughput, and the mean loss after every pass over the same data from the same weights.
+// the synchronous trainer steps once per mini-batch of 8 series, hogwild once per series.
+static void bench_hogwild() {
+	int input_dim = 2, hidden_dim = 16, output_dim = 2;
+	int size = 256, n = 33, chunk = 8, epochs = 10;
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("== hogwild vs synchronous training (%d series x %d timesteps, hidden_dim = %d, %d threads) ==\n", size, n - 1, hidden_dim, threads);
+
+	LSTM *sync = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.5, 0.5, -0.5, 0.5);
+	LSTM *hog = clone_lstm(sync);
+	gsl_vector ***batch = (gsl_vector ***)malloc(size * sizeof(gsl_vector **));
+	for (int b = 0; b < size; b++) batch[b] = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+	TRAINER *ts = create_trainer(sync, threads);
+	TRAINER *th = create_trainer(hog, threads);
+	double t_sync = 0, t_hog = 0;
+
+	printf("%6s %14s %14s\n", "epoch", "sync loss", "hogwild loss");
+	for (int e = 1; e <= epochs; e++) {
+		double E_sync = 0;
+		double start = now_sec();
+		for (int b = 0; b < size; b += chunk) E_sync += train_batch(ts, batch + b, chunk, n) * chunk;
+		t_sync += now_sec() - start;
+
+		start = now_sec();
+		double E_hog = train_hogwild(th, batch, size, n);
+		t_hog += now_sec() - start;
+
+		printf("%6d %14.4f %14.4f\n", e, E_sync / size, E_hog);
+	}
+	printf("series/s: sync %.1f, hogwild %.1f\n", epochs * size / t_sync, epochs * size / t_hog);
+
+	free_trainer(ts);
+	free_trainer(th);
+	for (int b = 0; b < size; b++) free_series_vectors(batch[b], n);
+	free(batch);
+	free_lstm(sync);
+	free_lstm(hog);
+	printf("\n");
+}
+
+// the parameter update the library used before optimizer.h, add_matrix on each of the 12 gate parameters and wy (get/set per element), kept here as the baseline
+static void add_matrix_update(LSTM *lstm, BCKPROP_CXT *cxt) {
+	gsl_matrix *w[13] = {lstm->wf, lstm->uf, lstm->wi, lstm->ui, lstm->wo, lstm->uo, lstm->wc, lstm->uc, lstm->wy};
+	gsl_matrix *dw[13] = {cxt->dEdWf, cxt->dEdUf, cxt->dEdWi, cxt->dEdUi, cxt->dEdWo, cxt->dEdUo, cxt->dEdWc, cxt->dEdUc, cxt->dEdWy};
+	gsl_vector *b[5] = {lstm->bf, lstm->bi, lstm->bo, lstm->bc, lstm->by};
+	gsl_vector *db[5] = {cxt->dEdbf, cxt->dEdbi, cxt->dEdbo, cxt->dEdbc, cxt->dEdby};
+
+	for (int k = 0; k < 9; k++) add_matrix(w[k], 1, dw[k], -0.001, 0, w[k]);
+	for (int k = 0; k < 5; k++) gsl_blas_daxpy(-0.001, db[k], b[k]);
+}
+
+// time of one parameter update against the time of the gradients of one series, i.e the share of a training step spent updating
+static void bench_optimizer() {
+	int input_dim = 8, hidden_dim = 128, output_dim = 8;
+	int n = 33;
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.1, 0.1, -0.1, 0.1);
+	gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+	BCKPROP_CXT *cxt = bp_create_cxt(lstm);
+
+	long reps = 0;
+	double start = now_sec();
+	while (now_sec() - start < 0.5) {
+		bp_gradients_lstm(lstm, series, n, cxt);
+		reps++;
+	}
+	double t_grad = (now_sec() - start) / reps;
+
+	printf("== parameter updates (hidden_dim = %d, %d parameters, gradients of %d timesteps: %.1f us) ==\n", hidden_dim, (int)(lstm->wp->size1 * lstm->wp->size2 + lstm->bp->size + lstm->wy->size1 * lstm->wy->size2 + lstm->by->size), n - 1, t_grad * 1e6);
+	printf("%-12s %12s %14s\n", "update", "us", "share of step");
+
+	// baseline
+	reps = 0;
+	start = now_sec();
+	while (now_sec() - start < 0.2) {
+		add_matrix_update(lstm, cxt);
+		reps++;
+	}
+	double t = (now_sec() - start) / reps;
+	printf("%-12s %12.2f %13.1f%%\n", "add_matrix", t * 1e6, 100 * t / (t + t_grad));
+
+	const char *names[4] = {"sgd", "momentum", "rmsprop", "adam"};
+	for (int k = 0; k < 4; k++) {
+		OPTIMIZER *opt = create_optimizer((OPT_TYPE)k, lstm);
+		opt->learning_rate = 1e-9; // keep the weights where they are, only the time matters
+
+		reps = 0;
+		start = now_sec();
+		while (now_sec() - start < 0.2) {
+			step_optimizer(opt, lstm, cxt);
+			reps++;
+		}
+		t = (now_sec() - start) / reps;
+		printf("%-12s %12.2f %13.1f%%\n", names[k], t * 1e6, 100 * t / (t + t_grad));
+
+		free_optimizer(opt);
+	}
+
+	bp_delete_cxt(cxt);
+	free_lstm(lstm);
+	free_series_vectors(series, n);
+	printf("\n");
+}
+
+// startup time of a model: reading the file into a new lstm against mapping it, with and without a first forward pass (which touches every page of wp)
+static void bench_load() {
+	int input_dim = 64, hidden_dim = 1024, output_dim = 64;
+	const char *path = "/tmp/rlstm_bench.bin";
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.1, 0.1, -0.1, 0.1);
+	double start = now_sec();
+	save_lstm(lstm, path);
+	double t_save = now_sec() - start;
+	free_lstm(lstm);
+
+	double mb = (4.0 * hidden_dim * (input_dim + hidden_dim) + output_dim * hidden_dim) * sizeof(double) / (1024 * 1024);
+	printf("== model files (hidden_dim = %d, %.1f MiB, page cache warm) ==\n", hidden_dim, mb);
+	printf("%-22s %10s\n", "", "ms");
+	printf("%-22s %10.2f\n", "save_lstm", t_save * 1e3);
+
+	const char *names[2] = {"load_lstm", "map_lstm"};
+	LSTM *(*open_model[2])(const char *) = {load_lstm, map_lstm};
+	for (int k = 0; k < 2; k++) {
+		start = now_sec();
+		lstm = open_model[k](path);
+		double t_open = now_sec() - start;
+
+		forward_pass_lstm(lstm);
+		double t_first = now_sec() - start;
+
+		char label[64];
+		snprintf(label, sizeof(label), "%s + forward", names[k]);
+		printf("%-22s %10.2f\n%-22s %10.2f\n", names[k], t_open * 1e3, label, t_first * 1e3);
+		free_lstm(lstm);
+	}
+
+	remove(path);
+	printf("\n");
+}
+
+// many streams on one model: a clone of the lstm per stream against one LSTM_STATE per stream on shared weights
+static void bench_sessions() {
+	int input_dim = 32, output_dim = 32, sessions = 64, steps = 200;
+	int hidden[2] = {64, 512};
+
+	printf("== inference sessions (%d streams, round robin) ==\n", sessions);
+	printf("%-8s %16s %16s %14s %14s\n", "hidden", "clone KiB/strm", "state KiB/strm", "clone us/step", "state us/step");
+
+	for (int k = 0; k < 2; k++) {
+		int hidden_dim = hidden[k];
+		LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.1, 0.1, -0.1, 0.1);
+		LSTM_WEIGHTS weights = weights_lstm(lstm);
+
+		gsl_vector *x = gsl_vector_alloc(input_dim);
+		for (int i = 0; i < input_dim; i++) gsl_vector_set(x, i, sin(i));
+
+		// only the doubles are counted (parameters + vectors for a clone, vectors for a state)
+		double params = 4.0 * hidden_dim * (input_dim + hidden_dim + 1) + output_dim * (hidden_dim + 1);
+		double vectors = input_dim + 8.0 * hidden_dim + output_dim;
+		double kib_clone = (params + vectors) * sizeof(double) / 1024;
+		double kib_state = (sizeof(LSTM_STATE) + vectors * sizeof(double)) / 1024;
+
+		LSTM **clones = (LSTM **)malloc(sessions * sizeof(LSTM *));
+		LSTM_STATE **states = (LSTM_STATE **)malloc(sessions * sizeof(LSTM_STATE *));
+		for (int s = 0; s < sessions; s++) {
+			clones[s] = clone_lstm(lstm);
+			states[s] = create_state_lstm(&weights);
+		}
+
+		double start = now_sec();
+		for (int t = 0; t < steps; t++) {
+			for (int s = 0; s < sessions; s++) forward_pass_n_lstm(clones[s], &x, 1);
+		}
+		double t_clone = (now_sec() - start) / ((double)steps * sessions);
+
+		start = now_sec();
+		for (int t = 0; t < steps; t++) {
+			for (int s = 0; s < sessions; s++) step_state_lstm(&weights, states[s], x);
+		}
+		double t_state = (now_sec() - start) / ((double)steps * sessions);
+
+		printf("%-8d %16.1f %16.1f %14.2f %14.2f\n", hidden_dim, kib_clone, kib_state, t_clone * 1e6, t_state * 1e6);
+
+		for (int s = 0; s < sessions; s++) {
+			free_lstm(clones[s]);
+			free_state_lstm(states[s]);
+		}
+		free(clones);
+		free(states);
+		gsl_vector_free(x);
+		free_lstm(lstm);
+	}
+	printf("\n");
+}
+
+// dynamic batching: every stream submits one step per round and the rounds are waited for, against stepping the streams one at a time
+static void bench_scheduler() {
+	int input_dim = 32, hidden_dim = 128, output_dim = 32, streams = 1024, rounds = 20;
+	double deadline = 200e-6;
+	int max_batch[4] = {1, 8, 32, 128};
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.1, 0.1, -0.1, 0.1);
+	LSTM_WEIGHTS weights = weights_lstm(lstm);
+	gsl_vector *x = gsl_vector_alloc(input_dim);
+	for (int i = 0; i < input_dim; i++) gsl_vector_set(x, i, sin(i));
+
+	printf("== dynamic batching (%d streams, hidden_dim = %d, deadline = %.0f us) ==\n", streams, hidden_dim, deadline * 1e6);
+	printf("%-14s %12s %10s %10s %10s\n", "", "steps/s", "batch", "p50 us", "p99 us");
+
+	LSTM_STATE *state = create_state_lstm(&weights);
+	double start = now_sec();
+	for (int r = 0; r < rounds; r++) {
+		for (int s = 0; s < streams; s++) step_state_lstm(&weights, state, x);
+	}
+	printf("%-14s %12.0f\n", "one at a time", rounds * streams / (now_sec() - start));
+	free_state_lstm(state);
+
+	SCHED_REQUEST *reqs = (SCHED_REQUEST *)malloc(streams * sizeof(SCHED_REQUEST));
+	for (int s = 0; s < streams; s++) {
+		reqs[s].stream = s;
+		reqs[s].x = x;
+		reqs[s].y = NULL;
+	}
+
+	for (int k = 0; k < 4; k++) {
+		SCHEDULER *sched = create_scheduler(lstm, streams, max_batch[k], deadline);
+
+		start = now_sec();
+		for (int r = 0; r < rounds; r++) {
+			for (int s = 0; s < streams; s++) sched_submit(sched, &reqs[s]);
+			for (int s = 0; s < streams; s++) sched_wait(sched, &reqs[s]);
+		}
+		double t = now_sec() - start;
+
+		SCHED_STATS stats;
+		sched_stats(sched, &stats);
+		char label[32];
+		snprintf(label, sizeof(label), "max_batch %d", max_batch[k]);
+		printf("%-14s %12.0f %10.1f %10.1f %10.1f\n", label, rounds * streams / t, stats.mean_batch, stats.p50 * 1e6, stats.p99 * 1e6);
+		free_scheduler(sched);
+	}
+
+	free(reqs);
+	gsl_vector_free(x);
+	free_lstm(lstm);
+	printf("\n");
+}
+
+// stacked lstm: the layers one after the other against the wavefront on 1..layers threads
+static void bench_stacked() {
+	int input_dim = 32, hidden_dim = 256, output_dim = 32, layers = 4, n = 200;
+	int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("== stacked lstm wavefront (%d layers, hidden_dim = %d, %d timesteps, %d cores) ==\n", layers, hidden_dim, n, cores);
+	printf("%-18s %10s %10s\n", "", "ms", "speedup");
+
+	LSTM *lstm[4];
+	for (int l = 0; l < layers; l++) {
+		lstm[l] = create_rand_lstm(l == 0 ? input_dim : hidden_dim, hidden_dim, l == layers - 1 ? output_dim : 1, -0.1, 0.1, -0.1, 0.1);
+	}
+	gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+	// layer by layer, every layer keeps the h of all timesteps for the next one
+	gsl_vector **hs = (gsl_vector **)malloc(n * sizeof(gsl_vector *));
+	for (int t = 0; t < n; t++) hs[t] = gsl_vector_alloc(hidden_dim);
+	double start = now_sec();
+	for (int l = 0; l < layers; l++) {
+		for (int t = 0; t < n; t++) {
+			gsl_vector *x = l == 0 ? series[t] : hs[t];
+			forward_pass_n_lstm(lstm[l], &x, 1);
+			gsl_vector_memcpy(hs[t], lstm[l]->h);
+		}
+	}
+	double base = now_sec() - start;
+	printf("%-18s %10.2f %9.2fx\n", "layer by layer", base * 1e3, 1.0);
+
+	for (int threads = 1; threads <= layers; threads++) {
+		STACKED_LSTM *stack = create_stacked_lstm(lstm, layers, threads);
+		reset_stacked_lstm(stack);
+
+		start = now_sec();
+		forward_pass_stacked_lstm(stack, series, n);
+		double t = now_sec() - start;
+
+		char label[32];
+		snprintf(label, sizeof(label), "wavefront %d thr", threads);
+		printf("%-18s %10.2f %9.2fx\n", label, t * 1e3, base / t);
+		free_stacked_lstm(stack);
+	}
+
+	for (int t = 0; t < n; t++) gsl_vector_free(hs[t]);
+	free(hs);
+	free_series_vectors(series, n);
+	for (int l = 0; l < layers; l++) free_lstm(lstm[l]);
+	printf("\n");
+}
+
+// bidirectional encoding: one direction, both directions one after the other, and both at the same time with forward_pass_bidir_lstm
+static void bench_bidir() {
+	int input_dim = 32, hidden_dim = 256, n = 500;
+	int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("== bidirectional lstm (hidden_dim = %d, %d timesteps, %d cores) ==\n", hidden_dim, n, cores);
+	printf("%-18s %10s\n", "", "ms");
+
+	LSTM *fwd = create_rand_lstm(input_dim, hidden_dim, input_dim, -0.1, 0.1, -0.1, 0.1);
+	LSTM *bwd = create_rand_lstm(input_dim, hidden_dim, input_dim, -0.1, 0.1, -0.1, 0.1);
+	gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+	double start = now_sec();
+	forward_pass_n_lstm(fwd, series, n);
+	double t_one = now_sec() - start;
+
+	start = now_sec();
+	forward_pass_n_lstm(fwd, series, n);
+	for (int t = n - 1; t >= 0; t--) forward_pass_n_lstm(bwd, &series[t], 1);
+	double t_seq = now_sec() - start;
+
+	BIDIR_LSTM *bidir = create_bidir_lstm(fwd, bwd);
+	gsl_matrix *out = gsl_matrix_alloc(n, 2 * hidden_dim);
+	start = now_sec();
+	forward_pass_bidir_lstm(bidir, series, n, out);
+	double t_bidir = now_sec() - start;
+
+	printf("%-18s %10.2f\n%-18s %10.2f\n%-18s %10.2f\n", "one direction", t_one * 1e3, "both, sequential", t_seq * 1e3, "both, concurrent", t_bidir * 1e3);
+
+	gsl_matrix_free(out);
+	free_bidir_lstm(bidir);
+	free_series_vectors(series, n);
+	free_lstm(fwd);
+	free_lstm(bwd);
+	printf("\n");
+}
+
+// sweep: every timed function over a grid of sizes, printed as csv (one row per configuration).
+// each configuration is warmed up, then timed in up to SWEEP_TRIALS trials (at least 3, fewer when the trials of a configuration take more than SWEEP_TIME seconds).
+// a trial repeats the function until it took at least 1 ms, the reported times are per call.
+// configurations doing more than budget flops per call, or needing a tape of more than SWEEP_MAX_TAPE bytes, are skipped.
+#define SWEEP_TRIALS 15
+#define SWEEP_TIME 2.0
+#define SWEEP_MAX_TAPE ((size_t)1 << 30)
+#define SWEEP_POOL 64 // distinct input vectors, the series of the sweep cycle through them
+
+typedef enum {SWEEP_STEP, SWEEP_SERIES, SWEEP_FWDPASS, SWEEP_BWDPASS} SWEEP_OP;
+
+static const char *sweep_names[4] = {"forward_pass_lstm", "forward_pass_n_lstm", "bp_fwdpass", "bp_bwdpass"};
+
+// one call of op, n timesteps
+static void sweep_call(SWEEP_OP op, LSTM *lstm, gsl_vector **series, int n, BP_TAPE *tape, BCKPROP_CXT *cxt) {
+	switch (op) {
+		case SWEEP_STEP:
+			forward_pass_lstm(lstm);
+			break;
+		case SWEEP_SERIES:
+			forward_pass_n_lstm(lstm, series, n);
+			break;
+		case SWEEP_FWDPASS:
+			bp_delete_tape(bp_fwdpass(lstm, series, n));
+			break;
+		case SWEEP_BWDPASS:
+			bp_bwdpass(lstm, tape, series + 1, cxt);
+			break;
+	}
+}
+
+// flops of one call: 2 * 4h * (i + h) for the gates and 2 * o * h for the output per timestep, the reverse sweep does about twice the work of a forward pass
+static double sweep_flops(SWEEP_OP op, int input_dim, int hidden_dim, int n) {
+	double step = 8.0 * hidden_dim * (input_dim + hidden_dim) + 2.0 * input_dim * hidden_dim;
+	return (op == SWEEP_BWDPASS ? 2 : 1) * step * n;
+}
+
+// nearest rank percentile of the sorted times
+static double percentile(double *sorted, int count, double p) {
+	int k = (int)ceil(p / 100 * count) - 1;
+	return sorted[k < 0 ? 0 : k];
+}
+
+static int compare_time(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void sweep_point(SWEEP_OP op, int input_dim, int hidden_dim, int n, gsl_vector **pool, double budget) {
+	double flops = sweep_flops(op, input_dim, hidden_dim, n);
+	if (flops > budget) return;
+
+	// output_dim = input_dim, the backward pass uses the series as its targets
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, input_dim, -0.1, 0.1, -0.1, 0.1);
+	if ((op == SWEEP_FWDPASS || op == SWEEP_BWDPASS) && bp_tape_size(lstm, n) > SWEEP_MAX_TAPE) {
+		free_lstm(lstm);
+		return;
+	}
+
+	gsl_vector **series = (gsl_vector **)malloc((n + 1) * sizeof(gsl_vector *));
+	for (int t = 0; t <= n; t++) series[t] = pool[t % SWEEP_POOL];
+	gsl_vector_memcpy(lstm->x, series[0]);
+
+	BP_TAPE *tape = op == SWEEP_BWDPASS ? bp_fwdpass(lstm, series, n) : NULL;
+	BCKPROP_CXT *cxt = op == SWEEP_BWDPASS ? bp_create_cxt(lstm) : NULL;
+
+	// warmup, at least one call and 20 ms, which also gives the number of calls per trial
+	long calls = 0;
+	double start = now_sec();
+	double elapsed = 0;
+	while (calls == 0 || elapsed < 0.02) {
+		sweep_call(op, lstm, series, n, tape, cxt);
+		calls++;
+		elapsed = now_sec() - start;
+	}
+	long reps = (long)ceil(1e-3 / (elapsed / calls));
+	if (reps < 1) reps = 1;
+
+	double times[SWEEP_TRIALS];
+	int trials = 0;
+	double total = 0;
+	while (trials < SWEEP_TRIALS && (trials < 3 || total < SWEEP_TIME)) {
+		start = now_sec();
+		for (long r = 0; r < reps; r++) sweep_call(op, lstm, series, n, tape, cxt);
+		double t = now_sec() - start;
+		times[trials++] = t / reps;
+		total += t;
+	}
+	qsort(times, trials, sizeof(double), compare_time);
+
+	double median = percentile(times, trials, 50);
+	printf("%s,%d,%d,%d,%d,%ld,%.9e,%.9e,%.9e,%.9e,%.9e,%.3f\n", sweep_names[op], input_dim, hidden_dim, n, trials, reps,
+		median, times[0], percentile(times, trials, 10), percentile(times, trials, 90), times[trials - 1], flops / median * 1e-9);
+	fflush(stdout);
+
+	if (tape != NULL) bp_delete_tape(tape);
+	if (cxt != NULL) bp_delete_cxt(cxt);
+	free(series);
+	free_lstm(lstm);
+}
+
+// budget = largest number of flops of one call that is still timed
+static void bench_sweep(double budget) {
+	int dims[6] = {1, 4, 16, 64, 256, 1024};
+	int lengths[6] = {1, 10, 100, 1000, 10000, 100000};
+
+	gsl_vector **pool = (gsl_vector **)malloc(SWEEP_POOL * sizeof(gsl_vector *));
+	for (int k = 0; k < SWEEP_POOL; k++) pool[k] = gsl_vector_alloc(1024);
+
+	printf("op,input_dim,hidden_dim,n,trials,reps,median_s,min_s,p10_s,p90_s,max_s,gflops\n");
+
+	for (int a = 0; a < 6; a++) {
+		for (int b = 0; b < 6; b++) {
+			for (int k = 0; k < SWEEP_POOL; k++) {
+				// the first dims[a] elements of a pool vector are the input
+				for (int i = 0; i < dims[a]; i++) gsl_vector_set(pool[k], i, sin(k + 0.1 * i));
+			}
+
+			gsl_vector_view views[SWEEP_POOL];
+			gsl_vector *inputs[SWEEP_POOL];
+			for (int k = 0; k < SWEEP_POOL; k++) {
+				views[k] = gsl_vector_subvector(pool[k], 0, dims[a]);
+				inputs[k] = &views[k].vector;
+			}
+
+			sweep_point(SWEEP_STEP, dims[a], dims[b], 1, inputs, budget);
+			for (int op = SWEEP_SERIES; op <= SWEEP_BWDPASS; op++) {
+				for (int l = 0; l < 6; l++) sweep_point(op, dims[a], dims[b], lengths[l], inputs, budget);
+			}
+		}
+	}
+
+	for (int k = 0; k < SWEEP_POOL; k++) gsl_vector_free(pool[k]);
+	free(pool);
+}
+
+// where the time of training goes, per phase (needs the library built with LSTM_INSTRUMENT)
+static void bench_instrument() {
+	int input_dim = 8, hidden_dim = 64, output_dim = 8;
+	int size = 16, n = 65, threads = 2;
+
+	printf("== instrumentation (%d batches of %d series x %d timesteps, hidden_dim = %d, %d threads) ==\n", 8, size, n - 1, hidden_dim, threads);
+	if (!instr_enabled()) {
+		printf("built without LSTM_INSTRUMENT, rebuild with: make clean && make bench BENCH_CFLAGS=\"-g -O2 -DLSTM_INSTRUMENT\"\n\n");
+		return;
+	}
+
+	LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, output_dim, -0.5, 0.5, -0.5, 0.5);
+	gsl_vector ***batch = (gsl_vector ***)malloc(size * sizeof(gsl_vector **));
+	for (int b = 0; b < size; b++) batch[b] = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+	TRAINER *trainer = create_trainer(lstm, threads);
+	instr_reset_all();
+	for (int k = 0; k < 8; k++) train_batch(trainer, batch, size, n);
+
+	INSTR_COUNTERS all;
+	instr_snapshot_all(&all);
+	printf("%-10s %12s %12s %10s %14s %10s\n", "phase", "calls", "ms", "ns/call", "KiB allocated", "GFLOP/s");
+	for (int p = 0; p < INSTR_PHASES; p++) {
+		INSTR_COUNTER *c = &all.phase[p];
+		printf("%-10s %12lld %12.2f %10.0f %14.1f %10.2f\n", instr_phase_name(p), c->calls, c->ns * 1e-6, c->calls > 0 ? (double)c->ns / c->calls : 0,
+			c->bytes / 1024.0, c->ns > 0 ? (double)c->flops / c->ns : 0);
+	}
+
+	free_trainer(trainer);
+	for (int b = 0; b < size; b++) free_series_vectors(batch[b], n);
+	free(batch);
+	free_lstm(lstm);
+	printf("\n");
+}
+
+// ns per forward_pass_lstm of lstm, repeated until at least 0.1s has passed
+static double time_forward(LSTM *lstm) {
+	long reps = 0;
+	double start = now_sec();
+	double elapsed = 0;
+
+	while (elapsed < 0.1) {
+		for (int k = 0; k < 64; k++) forward_pass_lstm(lstm);
+		reps += 64;
+		elapsed = now_sec() - start;
+	}
+
+	return elapsed * 1e9 / reps;
+}
+
+// forward pass latency of tiny models with the small matrix kernels against blas (lstm_small_kernel = 0)
+static void bench_small() {
+	int shapes[5][3] = {{1, 3, 1}, {4, 8, 4}, {8, 16, 8}, {8, 32, 8}, {32, 64, 32}};
+
+	printf("== small matrix kernels (up to %d elements) ==\n", LSTM_SMALL_KERNEL);
+	printf("%-14s %12s %12s %8s\n", "i x h x o", "blas ns", "kernel ns", "speedup");
+
+	for (int k = 0; k < 5; k++) {
+		LSTM *lstm = create_rand_lstm(shapes[k][0], shapes[k][1], shapes[k][2], -0.5, 0.5, -0.5, 0.5);
+
+		lstm_small_kernel = 0;
+		double t_blas = time_forward(lstm);
+		lstm_small_kernel = LSTM_SMALL_KERNEL;
+		double t_kernel = time_forward(lstm);
+
+		char label[32];
+		snprintf(label, sizeof(label), "%dx%dx%d", shapes[k][0], shapes[k][1], shapes[k][2]);
+		printf("%-14s %12.1f %12.1f %7.2fx\n", label, t_blas, t_kernel, t_blas / t_kernel);
+		free_lstm(lstm);
+	}
+	printf("\n");
+}
+
+// the fixed size cells of the fixed section
+LSTM_FIXED_DEFINE(fixed_1x3x1, 1, 3, 1)
+LSTM_FIXED_DEFINE(fixed_8x16x8, 8, 16, 8)
+LSTM_FIXED_DEFINE(fixed_8x32x8, 8, 32, 8)
+
+// ns per timestep of step(cell, x), repeated until at least 0.1s has passed
+#define TIME_FIXED(step, cell, x, out) { \
+	long reps = 0; \
+	double start = now_sec(); \
+	double elapsed = 0; \
+	while (elapsed < 0.1) { \
+		for (int k = 0; k < 64; k++) step(cell, x); \
+		reps += 64; \
+		elapsed = now_sec() - start; \
+	} \
+	out = elapsed * 1e9 / reps; \
+}
+
+// one timestep of a generic lstm against a fixed size cell with the same weights
+static void bench_fixed() {
+	printf("== fixed size cells (lstm_fixed.h) ==\n");
+	printf("%-10s %14s %14s %8s %12s\n", "i x h x o", "generic ns", "fixed ns", "speedup", "ns per unit");
+
+	for (int k = 0; k < 3; k++) {
+		int dims[3][3] = {{1, 3, 1}, {8, 16, 8}, {8, 32, 8}};
+		LSTM *lstm = create_rand_lstm(dims[k][0], dims[k][1], dims[k][2], -0.5, 0.5, -0.5, 0.5);
+		gsl_vector *x = gsl_vector_alloc(dims[k][0]);
+		for (int i = 0; i < dims[k][0]; i++) gsl_vector_set(x, i, sin(i));
+
+		double t_generic, t_fixed;
+		gsl_vector *arr[1] = {x};
+		#define GENERIC_STEP(l, v) forward_pass_n_lstm(l, v, 1)
+		TIME_FIXED(GENERIC_STEP, lstm, arr, t_generic);
+		#undef GENERIC_STEP
+
+		// the cells are static, the bigger ones don't belong on the stack
+		if (k == 0) {
+			static fixed_1x3x1 cell;
+			fixed_1x3x1_import(&cell, lstm);
+			TIME_FIXED(fixed_1x3x1_step, &cell, x->data, t_fixed);
+		} else if (k == 1) {
+			static fixed_8x16x8 cell;
+			fixed_8x16x8_import(&cell, lstm);
+			TIME_FIXED(fixed_8x16x8_step, &cell, x->data, t_fixed);
+		} else {
+			static fixed_8x32x8 cell;
+			fixed_8x32x8_import(&cell, lstm);
+			TIME_FIXED(fixed_8x32x8_step, &cell, x->data, t_fixed);
+		}
+
+		char label[32];
+		snprintf(label, sizeof(label), "%dx%dx%d", dims[k][0], dims[k][1], dims[k][2]);
+		printf("%-10s %14.1f %14.1f %7.2fx %12.2f\n", label, t_generic, t_fixed, t_generic / t_fixed, t_fixed / dims[k][1]);
+
+		gsl_vector_free(x);
+		free_lstm(lstm);
+	}
+	printf("\n");
+}
+
+// ns per timestep of a forward pass over series, one lstm or the other, repeated until at least 0.1s has passed
+static double time_series(LSTM *lstm, LSTMQ *lstmq, gsl_vector **series, int n) {
+	long reps = 0;
+	double start = now_sec();
+	double elapsed = 0;
+
+	while (elapsed < 0.1) {
+		if (lstm != NULL) forward_pass_n_lstm(lstm, series, n);
+		else forward_pass_n_lstmq(lstmq, series, n);
+		reps += n;
+		elapsed = now_sec() - start;
+	}
+
+	return elapsed * 1e9 / reps;
+}
+
+// series of n vectors of size dim, element i of timestep t = sin(0.1 * t + phase + i), smooth enough to be learned
+static gsl_vector **sine_series(int dim, int n, double phase) {
+	gsl_vector **series = series_vectors(dim, n, 0, 0, 0, 0);
+	for (int t = 0; t < n; t++) {
+		for (int i = 0; i < dim; i++) gsl_vector_set(series[t], i, sin(0.1 * t + phase + i));
+	}
+	return series;
+}
+
+// quantize lstm and report the accuracy drop on a held-out series, the memory of the weights and the time per timestep.
+// synthetic = 1 when held_out is random noise rather than data of the model: the losses mean nothing then, only the output errors are printed
+static void report_quant(LSTM *lstm, gsl_vector **held_out, int n, int synthetic) {
+	LSTMQ *lstmq = convert_lstmq(lstm);
+	LSTMQ_ERROR err;
+	error_lstmq(lstm, lstmq, held_out, n, &err);
+
+	int I = lstm->input_dim, H = lstm->hidden_dim, O = lstm->output_dim;
+	double bytes = (4.0 * H * (I + H + 1) + O * (H + 1.0)) * sizeof(double);
+	double bytes_q = weight_bytes_lstmq(lstmq);
+	double t = time_series(lstm, NULL, held_out, n);
+	double t_q = time_series(NULL, lstmq, held_out, n);
+
+	char label[32];
+	snprintf(label, sizeof(label), "%dx%dx%d", I, H, O);
+	char loss[2][32];
+	snprintf(loss[0], sizeof(loss[0]), synthetic ? "-" : "%.5g", err.loss);
+	snprintf(loss[1], sizeof(loss[1]), synthetic ? "-" : "%.5g", err.loss_q);
+	printf("%-12s %10.3g %10.3g %12s %12s %10.1f %10.1f %6.2fx %8.1f %8.1f %6.2fx\n", label, err.max_err, err.rms_err, loss[0], loss[1],
+		bytes / 1024, bytes_q / 1024, bytes / bytes_q, t, t_q, t / t_q);
+
+	free_lstmq(lstmq);
+}
+
+// reads a series from a text file: whitespace separated numbers, dim of them per timestep (i.e one timestep per line). returns NULL if the file can't be read,
+// doesn't hold a whole number of timesteps or has less than 2 of them
+static gsl_vector **read_series(const char *path, int dim, int *n) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		printf("ERROR: FAILED TO OPEN %s!\n", path);
+		return NULL;
+	}
+
+	int count = 0, size = 1024;
+	double *values = (double *)malloc(size * sizeof(double));
+	double v;
+	while (values != NULL && fscanf(file, "%lf", &v) == 1) {
+		if (count == size) {
+			size *= 2;
+			values = (double *)realloc(values, size * sizeof(double));
+			if (values == NULL) break;
+		}
+		values[count++] = v;
+	}
+	int complete = feof(file);
+	fclose(file);
+
+	if (values == NULL || !complete || count % dim != 0 || count / dim < 2) {
+		printf("ERROR: %s ISN'T A SERIES OF AT LEAST 2 VECTORS OF %d NUMBERS!\n", path, dim);
+		free(values);
+		return NULL;
+	}
+
+	*n = count / dim;
+	gsl_vector **series = series_vectors(dim, *n, 0, 0, 0, 0);
+	for (int t = 0; t < *n; t++) {
+		for (int i = 0; i < dim; i++) gsl_vector_set(series[t], i, values[t * dim + i]);
+	}
+
+	free(values);
+	return series;
+}
+
+// post-training int8 quantization (lstmq.h): ./build/bench quant [model file [held-out series file]]
+// quantizes the model file if one is given, checked on the held-out series from the second file (see read_series). without one it's checked on random values,
+// which only shows how far the int8 outputs are from the double ones, not how much the model gets worse, so the losses aren't printed.
+// without a model file: lstms of a few sizes trained for a while on a sine series (held-out: the same sine at another phase).
+// the losses are those of predicting the next element of the held-out series (0 when output_dim != input_dim)
+static void bench_quant(const char *path, const char *series_path) {
+	int n = 200;
+
+	printf("== int8 quantization (dot products: %s) ==\n", vm_isa());
+	if (path != NULL && series_path == NULL) printf("no held-out series given, the outputs are compared on random values and the losses are left out\n");
+	printf("%-12s %10s %10s %12s %12s %10s %10s %7s %8s %8s %7s\n", "i x h x o", "max err", "rms err", "loss", "loss int8", "KiB", "KiB int8", "memory", "ns", "ns int8", "speedup");
+
+	if (path != NULL) {
+		LSTM *lstm = load_lstm(path);
+		if (lstm == NULL) return;
+
+		gsl_vector **held_out;
+		if (series_path != NULL) {
+			held_out = read_series(series_path, lstm->input_dim, &n);
+			if (held_out == NULL) {
+				free_lstm(lstm);
+				return;
+			}
+		} else {
+			held_out = series_vectors(lstm->input_dim, n, -1, 1, -0.1, 0.1);
+		}
+
+		report_quant(lstm, held_out, n, series_path == NULL);
+		free_series_vectors(held_out, n);
+		free_lstm(lstm);
+		printf("\n");
+		return;
+	}
+
+	int dims[4][2] = {{1, 8}, {8, 32}, {32, 128}, {64, 256}};
+	for (int k = 0; k < 4; k++) {
+		int I = dims[k][0], H = dims[k][1];
+		LSTM *lstm = create_rand_lstm(I, H, I, -0.1, 0.1, -0.1, 0.1);
+		gsl_vector **train = sine_series(I, n, 0);
+		gsl_vector **held_out = sine_series(I, n, 1.5);
+
+		// adam keeps the bigger models from diverging on a loss summed over the whole series
+		BCKPROP_CXT *cxt = bp_create_cxt(lstm);
+		OPTIMIZER *opt = create_optimizer(OPT_ADAM, lstm);
+		opt->learning_rate = 0.01;
+		for (int epoch = 0; epoch < 30; epoch++) {
+			gsl_vector_set_zero(lstm->hp);
+			gsl_vector_set_zero(lstm->cp);
+			bp_gradients_lstm(lstm, train, n, cxt);
+			step_optimizer(opt, lstm, cxt);
+		}
+		bp_delete_cxt(cxt);
+		free_optimizer(opt);
+
+		report_quant(lstm, held_out, n, 0);
+
+		free_series_vectors(train, n);
+		free_series_vectors(held_out, n);
+		free_lstm(lstm);
+	}
+	printf("\n");
+}
+
+// ns per timestep of forward_pass_n_sparse_lstm over series, repeated until at least 0.1s has passed
+static double time_sparse(SPARSE_LSTM *sparse, gsl_vector **series, int n) {
+	long reps = 0;
+	double start = now_sec();
+	double elapsed = 0;
+
+	while (elapsed < 0.1) {
+		forward_pass_n_sparse_lstm(sparse, series, n);
+		reps += n;
+		elapsed = now_sec() - start;
+	}
+
+	return elapsed * 1e9 / reps;
+}
+
+// time per timestep of the dense and the CSR forward pass after pruning u to several densities, and the one create_sparse_lstm picks
+static void bench_sparse() {
+	int input_dim = 64, output_dim = 64, n = 32;
+	int hiddens[2] = {256, 1024};
+	double densities[7] = {1, 0.5, 0.4, 0.3, 0.2, 0.1, 0.05};
+
+	printf("== sparse recurrent weights (input_dim = %d, CSR at density <= %.2f) ==\n", input_dim, LSTM_SPARSE_DENSITY);
+	printf("%-10s %8s %12s %12s %8s %8s\n", "hidden", "density", "dense ns", "csr ns", "speedup", "picked");
+
+	for (int a = 0; a < 2; a++) {
+		LSTM *lstm = create_rand_lstm(input_dim, hiddens[a], output_dim, -0.1, 0.1, -0.1, 0.1);
+		gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+		for (int k = 0; k < 7; k++) {
+			double density = prune_lstm(lstm, densities[k]);
+
+			lstm_sparse_density = 0;
+			SPARSE_LSTM *dense = create_sparse_lstm(lstm);
+			lstm_sparse_density = 1;
+			SPARSE_LSTM *csr = create_sparse_lstm(lstm);
+			lstm_sparse_density = LSTM_SPARSE_DENSITY;
+			SPARSE_LSTM *picked = create_sparse_lstm(lstm);
+
+			double t_dense = time_sparse(dense, series, n);
+			double t_csr = time_sparse(csr, series, n);
+			printf("%-10d %8.2f %12.1f %12.1f %7.2fx %8s\n", hiddens[a], density, t_dense, t_csr, t_dense / t_csr, picked->u != NULL ? "csr" : "dense");
+
+			free_sparse_lstm(dense);
+			free_sparse_lstm(csr);
+			free_sparse_lstm(picked);
+		}
+
+		free_series_vectors(series, n);
+		free_lstm(lstm);
+	}
+	printf("\n");
+}
+
+// largest difference between the gradients of two contexts, relative to the largest gradient of a
+static double cxt_diff(BCKPROP_CXT *a, BCKPROP_CXT *b) {
+	const double *ga[4] = {a->dEdWp->data, a->dEdbp->data, a->dEdWy->data, a->dEdby->data};
+	const double *gb[4] = {b->dEdWp->data, b->dEdbp->data, b->dEdWy->data, b->dEdby->data};
+	int n[4] = {a->dEdWp->size1 * a->dEdWp->size2, a->dEdbp->size, a->dEdWy->size1 * a->dEdWy->size2, a->dEdby->size};
+	double diff = 0, scale = 0;
+
+	for (int k = 0; k < 4; k++) {
+		for (int i = 0; i < n[k]; i++) {
+			diff = fmax(diff, fabs(ga[k][i] - gb[k][i]));
+			scale = fmax(scale, fabs(ga[k][i]));
+		}
+	}
+
+	return scale > 0 ? diff / scale : diff;
+}
+
+// correctness of the backward pass: the bptt gradients against central finite differences of the loss, and the checkpointed gradients against bptt.
+// returns 1 if any error is above its tolerance, main exits with it so this can run as a check: ./build/bench gradcheck
+// wrong gradients are off by O(1). right ones only reach ~1e-4 relative error on gradients close to 0, where the finite differences cancel
+#define GRADCHECK_TOL 1e-3
+#define CKPT_TOL 1e-12
+static int bench_gradcheck() {
+	int shapes[3][2] = {{1, 3}, {4, 6}, {8, 16}};
+	int n = 12;
+	int failed = 0;
+
+	printf("== gradient check (series of %d, finite differences with eps = 1e-4) ==\n", n);
+	printf("%-10s %14s %14s %14s %14s %6s\n", "i x h", "fd rel err", "ckpt k=1", "ckpt k=auto", "ckpt k=n", "");
+
+	for (int a = 0; a < 3; a++) {
+		int input_dim = shapes[a][0], hidden_dim = shapes[a][1];
+		LSTM *lstm = create_rand_lstm(input_dim, hidden_dim, input_dim, -0.5, 0.5, -0.5, 0.5);
+		gsl_vector **series = series_vectors(input_dim, n, -1, 1, -0.1, 0.1);
+
+		double fd = bp_gradcheck_lstm(lstm, series, n, 1e-4);
+
+		// every run starts from the zero state
+		BCKPROP_CXT *ref = bp_create_cxt(lstm);
+		BCKPROP_CXT *cxt = bp_create_cxt(lstm);
+		bp_gradients_lstm(lstm, series, n, ref);
+
+		int ks[3] = {1, 0, n};
+		double ckpt[3];
+		for (int j = 0; j < 3; j++) {
+			gsl_vector_set_zero(lstm->hp);
+			gsl_vector_set_zero(lstm->cp);
+			bp_gradients_ckpt_lstm(lstm, series, n, ks[j], cxt);
+			ckpt[j] = cxt_diff(ref, cxt);
+		}
+
+		int ok = fd <= GRADCHECK_TOL && ckpt[0] <= CKPT_TOL && ckpt[1] <= CKPT_TOL && ckpt[2] <= CKPT_TOL;
+		if (!ok) failed = 1;
+
+		char label[32];
+		snprintf(label, sizeof(label), "%dx%d", input_dim, hidden_dim);
+		printf("%-10s %14.3g %14.3g %14.3g %14.3g %6s\n", label, fd, ckpt[0], ckpt[1], ckpt[2], ok ? "ok" : "FAIL");
+
+		bp_delete_cxt(ref);
+		bp_delete_cxt(cxt);
+		free_series_vectors(series, n);
+		free_lstm(lstm);
+	}
+	printf("tolerances: finite differences %g, checkpointed %g\n\n", GRADCHECK_TOL, CKPT_TOL);
+
+	return failed;
+}
+
+#ifdef __GLIBC__
+#define ALLOC_STEPS 1000
+
+// heap allocations of ALLOC_STEPS timesteps of a forward pass, after a few warmup timesteps
+#define COUNT_ALLOCS(step, out) { \
+	for (int k = 0; k < 16; k++) step; \
+	alloc_calls = 0; \
+	alloc_counting = 1; \
+	for (int k = 0; k < ALLOC_STEPS; k++) step; \
+	alloc_counting = 0; \
+	out = alloc_calls; \
+}
+#endif
+
+// heap allocations per timestep of the forward passes once they're warmed up, for the small kernels and the blas path.
+// every buffer of a timestep belongs to the lstm, so they should all be 0. returns 1 if a timestep allocated
+static int bench_alloc() {
+#ifdef __GLIBC__
+	int shapes[3][3] = {{1, 3, 1}, {8, 32, 8}, {64, 256, 64}};
+	int n = 8;
+	int failed = 0;
+
+	printf("== heap allocations per timestep (%d timesteps) ==\n", ALLOC_STEPS);
+	printf("%-14s %20s %20s %20s\n", "i x h x o", "forward_pass_lstm", "forward_pass_n_lstm", "forward_pass_lstmf");
+
+	for (int k = 0; k < 3; k++) {
+		LSTM *lstm = create_rand_lstm(shapes[k][0], shapes[k][1], shapes[k][2], -0.5, 0.5, -0.5, 0.5);
+		LSTMF *lstmf = convert_lstmf(lstm);
+		gsl_vector **series = sine_series(shapes[k][0], n, 0);
+		long single, multi, single_f;
+
+		COUNT_ALLOCS(forward_pass_lstm(lstm), single);
+		COUNT_ALLOCS(forward_pass_n_lstm(lstm, series, n), multi);
+		COUNT_ALLOCS(forward_pass_lstmf(lstmf), single_f);
+
+		char label[32];
+		snprintf(label, sizeof(label), "%dx%dx%d", shapes[k][0], shapes[k][1], shapes[k][2]);
+		printf("%-14s %20.3f %20.3f %20.3f\n", label, (double)single / ALLOC_STEPS, (double)multi / ((long)ALLOC_STEPS * n), (double)single_f / ALLOC_STEPS);
+		if (single != 0 || multi != 0 || single_f != 0) failed = 1;
+
+		free_series_vectors(series, n);
+		free_lstmf(lstmf);
+		free_lstm(lstm);
+	}
+
+	if (failed) printf("ERROR: A FORWARD PASS ALLOCATES ON THE HEAP!\n");
+	printf("\n");
+	return failed;
+#else
+	printf("== heap allocations per timestep ==\nskipped, allocations are only counted with glibc\n\n");
+	return 0;
+#endif
+}
+
+int main(int argc, char **argv) {
+	init_utils();
+
+	// run every section, or only the one named on the command line
+	const char *only = argc > 1 ? argv[1] : NULL;
+
+	// the sweep takes long and prints csv, so it only runs on its own: ./build/bench sweep [budget]
+	if (only != NULL && strcmp(only, "sweep") == 0) {
+		bench_sweep(argc > 2 ? atof(argv[2]) : 2e9);
+		return 0;
+	}
+
+	// quantizing a model file is a tool of its own: ./build/bench quant model.bin [held-out series]
+	if (only != NULL && strcmp(only, "quant") == 0 && argc > 2) {
+		bench_quant(argv[2], argc > 3 ? argv[3] : NULL);
+		return 0;
+	}
+
+	int failed = 0; // set by the sections that check results
+	if (only == NULL || strcmp(only, "activations") == 0) bench_activations();
+	if (only == NULL || strcmp(only, "checkpoint") == 0) bench_checkpoint();
+	if (only == NULL || strcmp(only, "parallel") == 0) bench_parallel();
+	if (only == NULL || strcmp(only, "hogwild") == 0) bench_hogwild();
+	if (only == NULL || strcmp(only, "optimizer") == 0) bench_optimizer();
+	if (only == NULL || strcmp(only, "load") == 0) bench_load();
+	if (only == NULL || strcmp(only, "sessions") == 0) bench_sessions();
+	if (only == NULL || strcmp(only, "scheduler") == 0) bench_scheduler();
+	if (only == NULL || strcmp(only, "stacked") == 0) bench_stacked();
+	if (only == NULL || strcmp(only, "bidir") == 0) bench_bidir();
+	if (only == NULL || strcmp(only, "instrument") == 0) bench_instrument();
+	if (only == NULL || strcmp(only, "small") == 0) bench_small();
+	if (only == NULL || strcmp(only, "fixed") == 0) bench_fixed();
+	if (only == NULL || strcmp(only, "quant") == 0) bench_quant(NULL, NULL);
+	if (only == NULL || strcmp(only, "sparse") == 0) bench_sparse();
+	if (only == NULL || strcmp(only, "gradcheck") == 0) failed |= bench_gradcheck();
+	if (only == NULL || strcmp(only, "alloc") == 0) failed |= bench_alloc();
+
+	return failed;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
@@ -6,81 +7,495 @@
 #include "backprop.h"
 #include "lstm.h"
 #include "nutils.h"
+#include "optimizer.h"
+#include "instrument.h"
 
 static double learning_rate = 0.001;
 
-void bp_series_lstm(LSTM *lstm, gsl_vector **series, int n) {
-	printf("beginning backpropagation...");
-
-	// dE/dh gradient
-	LSTM_L *list = bp_fwdpass(lstm, series, n);
+double bp_series_lstm(LSTM *lstm, gsl_vector **series, int n) {
 	BCKPROP_CXT *context = bp_create_cxt(lstm);
+	double E = bp_gradients_lstm(lstm, series, n, context);
 
-	for (int i = 0; i < n; i++) {
-		// formulas in backprop.h
-		gsl_vector *dEdc = gsl_vector_calloc(lstm->hidden_dim);
-		bp_tdEdc(i, list, series, dEdc);
+	bp_learn_cxt(lstm, context);
 
-		gsl_vector *dcdf = gsl_vector_calloc(lstm->hidden_dim);
-		
-		gsl_matrix *dfdW = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
+	bp_delete_cxt(context);
+	return E;
+}
 
-		// calculate the final dEdWft, gradient loss w.r.t weight of forget gate.
-		gsl_matrix *dEdWf = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim); 
-		
+void bp_learn_cxt(LSTM *lstm, BCKPROP_CXT *cxt) {
+	// plain sgd has no state, so the optimizer lives on the stack
+	OPTIMIZER sgd;
+	sgd.type = OPT_SGD;
+	sgd.learning_rate = learning_rate;
+	sgd.beta1 = 0;
+	sgd.beta2 = 0;
+	sgd.epsilon = 0;
+	sgd.t = 0;
+	sgd.size = 0;
+	sgd.m = NULL;
+	sgd.v = NULL;
+
+	step_optimizer(&sgd, lstm, cxt);
+}
 
-		// add up all the gradients
+double bp_gradients_lstm(LSTM *lstm, gsl_vector **series, int n, BCKPROP_CXT *cxt) {
+	bp_zero_cxt(cxt);
 
+	// the last element of the series is only a target
+	BP_TAPE *tape = bp_fwdpass(lstm, series, n - 1);
+	bp_bwdpass(lstm, tape, series + 1, cxt);
+	bp_delete_tape(tape);
+
+	return cxt->E;
+}
+
+// reverse sweep over the timesteps of tape.
+// dhn and dcn are the gradients flowing into the last timestep of the tape from the timestep after it (0 at the end of a series):
+// dhn = dE/dh flowing back from t+1 (U^T * dE/dX(t+1)), dcn = dE/dc flowing back from t+1 (f(t+1) * dE/dc(t+1)).
+// on return they hold the gradients flowing out of the first timestep, so a series can be swept one tape after another.
+static void bwd_sweep(LSTM *lstm, BP_TAPE *tape, gsl_vector **targets, BCKPROP_CXT *cxt, gsl_vector *dhn, gsl_vector *dcn) {
+	int input_dim = tape->input_dim;
+	int hidden_dim = tape->hidden_dim;
+	INSTR_BEGIN(INSTR_BWDPASS);
+
+	// everything is allocated once per sweep, not per timestep
+	gsl_vector *dEdy = gsl_vector_calloc(tape->output_dim);
+	gsl_vector *dEdh = gsl_vector_calloc(hidden_dim);
+	gsl_vector *dEdc = gsl_vector_calloc(hidden_dim);
+	gsl_vector *dhdc = gsl_vector_calloc(hidden_dim);
+	gsl_vector *dX = gsl_vector_calloc(4 * hidden_dim); // dE/dX of the packed pre-activations [Xf; Xi; Xo; Xca]
+	gsl_vector *dxh = gsl_vector_calloc(input_dim + hidden_dim); // wp^T * dX = [dE/dx; dE/dhp]
+
+	gsl_vector_view dXf = gsl_vector_subvector(dX, 0, hidden_dim);
+	gsl_vector_view dXi = gsl_vector_subvector(dX, hidden_dim, hidden_dim);
+	gsl_vector_view dXo = gsl_vector_subvector(dX, 2 * hidden_dim, hidden_dim);
+	gsl_vector_view dXca = gsl_vector_subvector(dX, 3 * hidden_dim, hidden_dim);
+	gsl_vector_view dEdhp = gsl_vector_subvector(dxh, input_dim, hidden_dim);
+
+	for (int t = tape->n - 1; t >= 0; t--) {
+		BP_STEP step = bp_tape_step(tape, t);
+		gsl_vector_view xh = gsl_vector_view_array(step.x.data, input_dim + hidden_dim); // x and hp are next to each other in the tape
+
+		// output layer: E = (y - target)^2, dE/dy = 2(y - target)
+		double e;
+		gsl_blas_dcopy(&step.y, dEdy);
+		gsl_blas_daxpy(-1, targets[t], dEdy);
+		gsl_blas_ddot(dEdy, dEdy, &e);
+		cxt->E += e;
+		gsl_blas_dscal(2, dEdy);
+
+		gsl_blas_dger(1, dEdy, &step.h, cxt->dEdWy); // dE/dWy += dE/dy * h^T
+		gsl_blas_daxpy(1, dEdy, cxt->dEdby);
+
+		// dE/dht = (dE/dy)^T * Wy + U^T * dE/dX(t+1)
+		gsl_blas_dcopy(dhn, dEdh);
+		gsl_blas_dgemv(CblasTrans, 1, lstm->wy, dEdy, 1, dEdh);
+
+		// dE/dct = dE/dht * ot(sech^2(ct)) + f(t+1) * dE/dc(t+1)
+		bp_dhdc(&step, dhdc);
+		hdm_vector(dEdh, dhdc, dEdc);
+		gsl_blas_daxpy(1, dcn, dEdc);
+
+		// gradients wrt the pre-activations of every gate
+		bp_dEdf(lstm, &step, dEdc, &dXf.vector);
+		bp_dEdi(lstm, &step, dEdc, &dXi.vector);
+		bp_dEdo(lstm, &step, dEdh, &dXo.vector);
+		bp_dEdca(lstm, &step, dEdc, &dXca.vector);
+
+		// X = Wp * [x; hp] + bp, so dE/dWp += dX * [x; hp]^T and dE/dbp += dX, this covers W and U of all four gates
+		gsl_blas_dger(1, dX, &xh.vector, cxt->dEdWp);
+		gsl_blas_daxpy(1, dX, cxt->dEdbp);
+
+		// carry the gradients to timestep t-1
+		gsl_blas_dgemv(CblasTrans, 1, lstm->wp, dX, 0, dxh);
+		gsl_blas_dcopy(&dEdhp.vector, dhn);
+		hdm_vector(dEdc, &step.f, dcn);
 	}
 
-	lstml_deletex(list);
-	bp_delete_cxt(context);
+	gsl_vector_free(dEdy);
+	gsl_vector_free(dEdh);
+	gsl_vector_free(dEdc);
+	gsl_vector_free(dhdc);
+	gsl_vector_free(dX);
+	gsl_vector_free(dxh);
+
+	// flops per timestep: the two outer products and the two transposed products, of wp and of wy. bytes: the vectors above
+	INSTR_END(INSTR_BWDPASS, (double)tape->n * (4 * lstm->wp->size1 * lstm->wp->size2 + 4 * lstm->wy->size1 * lstm->wy->size2),
+		(tape->output_dim + 3 * hidden_dim + 4 * hidden_dim + input_dim + hidden_dim) * sizeof(double));
 }
 
-LSTM_L *bp_fwdpass(LSTM *lstm, gsl_vector **series, int n) {
-	LSTM_L *l = lstml_create(); // create lstm list (unrolled lstm)
+void bp_bwdpass(LSTM *lstm, BP_TAPE *tape, gsl_vector **targets, BCKPROP_CXT *cxt) {
+	gsl_vector *dhn = gsl_vector_calloc(tape->hidden_dim);
+	gsl_vector *dcn = gsl_vector_calloc(tape->hidden_dim);
 
-	for (int i = 0; i < n; i++) {
-		if (i > 0) {
-			// copy outputs from last lstm output
-			gsl_blas_dcopy(lstm->c, lstm->cp);
-			gsl_blas_dcopy(lstm->h, lstm->hp);
+	bwd_sweep(lstm, tape, targets, cxt, dhn, dcn);
+
+	gsl_vector_free(dhn);
+	gsl_vector_free(dcn);
+}
+
+// loss of the lstm on series, starting from the state hp, cp
+static double series_loss(LSTM *lstm, gsl_vector **series, int n, gsl_vector *hp, gsl_vector *cp) {
+	double E = 0;
+
+	gsl_blas_dcopy(hp, lstm->hp);
+	gsl_blas_dcopy(cp, lstm->cp);
+
+	BP_TAPE *tape = bp_fwdpass(lstm, series, n - 1);
+	for (int t = 0; t < n - 1; t++) {
+		BP_STEP step = bp_tape_step(tape, t);
+		for (int k = 0; k < (int)step.y.size; k++) {
+			double d = gsl_vector_get(&step.y, k) - gsl_vector_get(series[t + 1], k);
+			E += d * d;
 		}
+	}
+	bp_delete_tape(tape);
+
+	return E;
+}
+
+// largest relative error between the analytic gradients g and the finite differences of the parameters p
+static double gradcheck_block(LSTM *lstm, gsl_vector **series, int n, gsl_vector *hp, gsl_vector *cp, double *p, double *g, int size, double eps) {
+	double err = 0;
+
+	for (int k = 0; k < size; k++) {
+		double w = p[k];
+
+		p[k] = w + eps;
+		double E1 = series_loss(lstm, series, n, hp, cp);
+		p[k] = w - eps;
+		double E2 = series_loss(lstm, series, n, hp, cp);
+		p[k] = w;
+
+		double num = (E1 - E2) / (2 * eps);
+		double scale = fabs(num) + fabs(g[k]);
+		if (scale > 1e-12) {
+			double e = fabs(num - g[k]) / scale;
+			if (e > err) err = e;
+		}
+	}
+
+	return err;
+}
+
+double bp_gradcheck_lstm(LSTM *lstm, gsl_vector **series, int n, double eps) {
+	int hidden_dim = lstm->hidden_dim;
+
+	// save the starting state, every forward pass has to begin from it
+	gsl_vector *hp = gsl_vector_calloc(hidden_dim);
+	gsl_vector *cp = gsl_vector_calloc(hidden_dim);
+	gsl_blas_dcopy(lstm->hp, hp);
+	gsl_blas_dcopy(lstm->cp, cp);
+
+	BCKPROP_CXT *cxt = bp_create_cxt(lstm);
+	bp_gradients_lstm(lstm, series, n, cxt);
+
+	// the packed blocks are contiguous, so each parameter block is checked as one flat array
+	double err = 0, e;
+	e = gradcheck_block(lstm, series, n, hp, cp, lstm->wp->data, cxt->dEdWp->data, lstm->wp->size1 * lstm->wp->size2, eps);
+	if (e > err) err = e;
+	e = gradcheck_block(lstm, series, n, hp, cp, lstm->bp->data, cxt->dEdbp->data, lstm->bp->size, eps);
+	if (e > err) err = e;
+	e = gradcheck_block(lstm, series, n, hp, cp, lstm->wy->data, cxt->dEdWy->data, lstm->wy->size1 * lstm->wy->size2, eps);
+	if (e > err) err = e;
+	e = gradcheck_block(lstm, series, n, hp, cp, lstm->by->data, cxt->dEdby->data, lstm->by->size, eps);
+	if (e > err) err = e;
+
+	gsl_blas_dcopy(hp, lstm->hp);
+	gsl_blas_dcopy(cp, lstm->cp);
+
+	bp_delete_cxt(cxt);
+	gsl_vector_free(hp);
+	gsl_vector_free(cp);
+
+	return err;
+}
+
+size_t bp_tape_size(LSTM *lstm, int n) {
+	size_t stride = lstm->input_dim + 8 * lstm->hidden_dim + lstm->output_dim;
+	return sizeof(BP_TAPE) + (size_t)n * stride * sizeof(double);
+}
+
+BP_TAPE *bp_create_tape(LSTM *lstm, int n) {
+	// the struct and all the timesteps are allocated together
+	BP_TAPE *tape = (BP_TAPE *)malloc(bp_tape_size(lstm, n));
+	if (tape == NULL) printf("ERROR: FAILED TO ALLOCATE ACTIVATION TAPE!\n");
+	INSTR_ALLOC(INSTR_FWDPASS, bp_tape_size(lstm, n));
+
+	tape->n = n;
+	tape->rows = n;
+	tape->start = 0;
+	tape->input_dim = lstm->input_dim;
+	tape->hidden_dim = lstm->hidden_dim;
+	tape->output_dim = lstm->output_dim;
+	tape->stride = lstm->input_dim + 8 * lstm->hidden_dim + lstm->output_dim;
+
+	return tape;
+}
 
+void bp_delete_tape(BP_TAPE *tape) {
+	free(tape);
+}
+
+void bp_tape_record(BP_TAPE *tape, int t, LSTM *lstm) {
+	double *row = tape->data + (size_t)((tape->start + t) % tape->rows) * tape->stride;
+	int hidden_dim = tape->hidden_dim;
+
+	// the lstm keeps x, hp and f, i, o, ca packed in xh and g, so the row is filled with 5 copies
+	gsl_vector_view xh = gsl_vector_view_array(row, tape->input_dim + hidden_dim);
+	gsl_vector_view cp = gsl_vector_view_array(row + tape->input_dim + hidden_dim, hidden_dim);
+	gsl_vector_view g = gsl_vector_view_array(cp.vector.data + hidden_dim, 4 * hidden_dim);
+	gsl_vector_view ch = gsl_vector_view_array(g.vector.data + 4 * hidden_dim, hidden_dim);
+	gsl_vector_view hh = gsl_vector_view_array(ch.vector.data + hidden_dim, hidden_dim);
+	gsl_vector_view y = gsl_vector_view_array(hh.vector.data + hidden_dim, tape->output_dim);
+
+	gsl_blas_dcopy(lstm->xh, &xh.vector);
+	gsl_blas_dcopy(lstm->cp, &cp.vector);
+	gsl_blas_dcopy(lstm->g, &g.vector);
+	gsl_blas_dcopy(lstm->c, &ch.vector);
+	gsl_blas_dcopy(lstm->h, &hh.vector);
+	gsl_blas_dcopy(lstm->y, &y.vector);
+}
+
+BP_STEP bp_tape_step(BP_TAPE *tape, int t) {
+	BP_STEP step;
+	double *p = tape->data + (size_t)((tape->start + t) % tape->rows) * tape->stride;
+	int hidden_dim = tape->hidden_dim;
+
+	// walk along the row: [x | hp | cp | f | i | o | ca | c | h | y]
+	step.x = gsl_vector_view_array(p, tape->input_dim).vector; p += tape->input_dim;
+	step.hp = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.cp = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.f = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.i = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.o = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.ca = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.c = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.h = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	step.y = gsl_vector_view_array(p, tape->output_dim).vector;
+
+	return step;
+}
+
+// run the lstm over n elements of series and record them into the first n rows of tape.
+// hp and cp of the lstm are the starting state, after the call they hold the state after the last element (like forward_pass_n_lstm).
+static void record_series(LSTM *lstm, BP_TAPE *tape, gsl_vector **series, int n) {
+	INSTR_BEGIN(INSTR_FWDPASS);
+
+	for (int i = 0; i < n; i++) {
 		input_vector_lstm(lstm, series[i]); // input series data at index into lstm
 		forward_pass_lstm(lstm); // forward pass lstm
 
-		LSTM *clone = clone_lstm(lstm); // clone lstm and append it to list
-		lstml_append(l, clone);
+		bp_tape_record(tape, i, lstm); // store the vectors of this timestep
+
+		// the outputs become the previous state of the next element
+		gsl_blas_dcopy(lstm->c, lstm->cp);
+		gsl_blas_dcopy(lstm->h, lstm->hp);
+	}
+
+	INSTR_END(INSTR_FWDPASS, (double)n * (2 * lstm->wp->size1 * lstm->wp->size2 + 2 * lstm->wy->size1 * lstm->wy->size2), 0);
+}
+
+BP_TAPE *bp_fwdpass(LSTM *lstm, gsl_vector **series, int n) {
+	BP_TAPE *tape = bp_create_tape(lstm, n); // create activation tape (unrolled lstm)
+	record_series(lstm, tape, series, n);
+	return tape;
+}
+
+double bp_accumulate_lstm(LSTM *lstm, BP_TAPE *tape, gsl_vector **series, int n, BCKPROP_CXT *cxt) {
+	double E = cxt->E;
+
+	// the tape is reused, only the first n - 1 rows are filled
+	tape->start = 0;
+	tape->n = n - 1;
+	record_series(lstm, tape, series, n - 1);
+	bp_bwdpass(lstm, tape, series + 1, cxt);
+
+	return cxt->E - E;
+}
+
+int bp_ckpt_interval(int n) {
+	int k = (int)ceil(sqrt((double)n));
+	return k > 0 ? k : 1;
+}
+
+size_t bp_ckpt_size(LSTM *lstm, int n, int k) {
+	if (k <= 0) k = bp_ckpt_interval(n);
+	if (k > n) k = n;
+	if (k < 1) k = 1;
+
+	int segments = (n + k - 1) / k;
+	return bp_tape_size(lstm, k) + (size_t)(segments + 1) * 2 * lstm->hidden_dim * sizeof(double);
+}
+
+// copy the state hp, cp of the lstm into (save = 1) or out of (save = 0) row s of the checkpoints
+static void ckpt_state(gsl_matrix *ckpt, int s, LSTM *lstm, int save) {
+	int hidden_dim = lstm->hidden_dim;
+	gsl_vector_view hp = gsl_matrix_subrow(ckpt, s, 0, hidden_dim);
+	gsl_vector_view cp = gsl_matrix_subrow(ckpt, s, hidden_dim, hidden_dim);
+
+	if (save) {
+		gsl_blas_dcopy(lstm->hp, &hp.vector);
+		gsl_blas_dcopy(lstm->cp, &cp.vector);
+	} else {
+		gsl_blas_dcopy(&hp.vector, lstm->hp);
+		gsl_blas_dcopy(&cp.vector, lstm->cp);
+	}
+}
+
+double bp_gradients_ckpt_lstm(LSTM *lstm, gsl_vector **series, int n, int k, BCKPROP_CXT *cxt) {
+	int steps = n - 1; // the last element of the series is only a target
+	int hidden_dim = lstm->hidden_dim;
+
+	bp_zero_cxt(cxt);
+	if (steps <= 0) return 0; // nothing to predict, same as bp_gradients_lstm
+
+	if (k <= 0) k = bp_ckpt_interval(steps);
+	if (k > steps) k = steps;
+	if (k < 1) k = 1;
+	int segments = (steps + k - 1) / k;
+
+	// forward sweep: only the state entering every k-th timestep is kept, the last row is the state after the series
+	gsl_matrix *ckpt = gsl_matrix_calloc(segments + 1, 2 * hidden_dim);
+	for (int t = 0; t < steps; t++) {
+		if (t % k == 0) ckpt_state(ckpt, t / k, lstm, 1);
+
+		input_vector_lstm(lstm, series[t]);
+		forward_pass_lstm(lstm);
+
+		gsl_blas_dcopy(lstm->c, lstm->cp);
+		gsl_blas_dcopy(lstm->h, lstm->hp);
 	}
+	ckpt_state(ckpt, segments, lstm, 1);
+
+	// backward sweep: recompute the tape of one segment at a time from its checkpoint, last segment first,
+	// and carry dE/dh and dE/dc from each segment into the one before it
+	BP_TAPE *tape = bp_create_tape(lstm, k);
+	gsl_vector *dhn = gsl_vector_calloc(hidden_dim);
+	gsl_vector *dcn = gsl_vector_calloc(hidden_dim);
+
+	for (int s = segments - 1; s >= 0; s--) {
+		int t0 = s * k;
+		int len = steps - t0 < k ? steps - t0 : k;
+
+		ckpt_state(ckpt, s, lstm, 0);
+		tape->n = len; // the tape is reused, only the first len rows are filled
+		record_series(lstm, tape, series + t0, len);
+		bwd_sweep(lstm, tape, series + t0 + 1, cxt, dhn, dcn);
+	}
+
+	// leave the lstm in the state after the series, like bp_gradients_lstm
+	ckpt_state(ckpt, segments, lstm, 0);
+
+	gsl_matrix_free(ckpt);
+	bp_delete_tape(tape);
+	gsl_vector_free(dhn);
+	gsl_vector_free(dcn);
 
-	return l;
+	return cxt->E;
 }
 
-void bp_X(BP_GATES gate, LSTM *lstm, gsl_vector *out) {
+BP_STREAM *bp_create_stream(LSTM *lstm, int k1, int k2) {
+	if (k1 < 1 || k2 < 1) {
+		printf("ERROR: BACKPROP STREAM NEEDS K1 AND K2 OF AT LEAST 1!\n");
+		return NULL;
+	}
+
+	BP_STREAM *stream = (BP_STREAM *)malloc(sizeof(BP_STREAM));
+	if (stream == NULL) printf("ERROR: FAILED TO ALLOCATE BACKPROP STREAM!\n");
+
+	stream->lstm = lstm;
+	stream->k1 = k1;
+	stream->k2 = k2;
+	stream->steps = 0;
+	stream->E = 0;
+	stream->opt = NULL;
+
+	// one row more than the window, the input of the newest timestep is the target of the last timestep of the window
+	stream->tape = bp_create_tape(lstm, k1 + 1);
+	stream->tape->n = 0;
+	stream->cxt = bp_create_cxt(lstm);
+
+	stream->tv = (gsl_vector *)malloc(k1 * sizeof(gsl_vector));
+	stream->targets = (gsl_vector **)malloc(k1 * sizeof(gsl_vector *));
+	if (stream->tv == NULL || stream->targets == NULL) printf("ERROR: FAILED TO ALLOCATE BACKPROP STREAM TARGETS!\n");
+
+	return stream;
+}
+
+void bp_delete_stream(BP_STREAM *stream) {
+	bp_delete_tape(stream->tape);
+	bp_delete_cxt(stream->cxt);
+	free(stream->tv);
+	free(stream->targets);
+	free(stream);
+}
+
+int bp_stream_push(BP_STREAM *stream, gsl_vector *x) {
+	LSTM *lstm = stream->lstm;
+	BP_TAPE *tape = stream->tape;
+
+	// once the ring is full, the oldest timestep is dropped to make room
+	if (tape->n == tape->rows) {
+		tape->start = (tape->start + 1) % tape->rows;
+		tape->n--;
+	}
+
+	// forward pass of the new timestep, the state carries over from the previous sample
+	input_vector_lstm(lstm, x);
+	forward_pass_lstm(lstm);
+	bp_tape_record(tape, tape->n, lstm);
+	tape->n++;
+
+	gsl_blas_dcopy(lstm->c, lstm->cp);
+	gsl_blas_dcopy(lstm->h, lstm->hp);
+
+	stream->steps++;
+	if (stream->steps % stream->k2 != 0 || tape->n < 2) return 0;
+
+	// backpropagate over every timestep whose target has arrived (up to k1), the target of timestep t is the input of t+1
+	int window = tape->n - 1;
+	for (int t = 0; t < window; t++) {
+		stream->tv[t] = bp_tape_step(tape, t + 1).x;
+		stream->targets[t] = &stream->tv[t];
+	}
+
+	bp_zero_cxt(stream->cxt);
+	tape->n = window;
+	bp_bwdpass(lstm, tape, stream->targets, stream->cxt);
+	tape->n = window + 1;
+
+	if (stream->opt != NULL) step_optimizer(stream->opt, lstm, stream->cxt);
+	else bp_learn_cxt(lstm, stream->cxt);
+	stream->E = stream->cxt->E;
+
+	return 1;
+}
+
+void bp_X(BP_GATES gate, LSTM *lstm, BP_STEP *step, gsl_vector *out) {
 	gsl_vector *t1 = gsl_vector_calloc(lstm->hidden_dim);
 	gsl_vector *t2 = gsl_vector_calloc(lstm->hidden_dim);
 	gsl_vector *t3 = gsl_vector_calloc(lstm->hidden_dim);
 
 	switch (gate) { // t1 = W * x, t2 = U * hp, t3 = b
 		case FORGET:
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wf, lstm->x, 0, t1);
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uf, lstm->hp, 0, t2);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wf, &step->x, 0, t1);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uf, &step->hp, 0, t2);
 			gsl_blas_dcopy(lstm->bf, t3);
 			break;
 		case INPUT:
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wi, lstm->x, 0, t1);
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->ui, lstm->hp, 0, t2);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wi, &step->x, 0, t1);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->ui, &step->hp, 0, t2);
 			gsl_blas_dcopy(lstm->bi, t3);
 			break;
 		case OUTPUT:
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wo, lstm->x, 0, t1);
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uo, lstm->hp, 0, t2);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wo, &step->x, 0, t1);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uo, &step->hp, 0, t2);
 			gsl_blas_dcopy(lstm->bo, t3);
 			break;
 		case CAND:
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wc, lstm->x, 0, t1);
-			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uc, lstm->hp, 0, t2);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->wc, &step->x, 0, t1);
+			gsl_blas_dgemv(CblasNoTrans, 1, lstm->uc, &step->hp, 0, t2);
 			gsl_blas_dcopy(lstm->bc, t3);
 			break;
 	}
@@ -94,9 +509,9 @@ void bp_X(BP_GATES gate, LSTM *lstm, gsl_vector *out) {
 	gsl_vector_free(t3);
 }
 
-void bp_dEdh(LSTM *lstm, gsl_vector *y, gsl_vector *out) {
+void bp_dEdh(LSTM *lstm, BP_STEP *step, gsl_vector *y, gsl_vector *out) {
 	gsl_vector *t = gsl_vector_calloc(lstm->output_dim);
-	gsl_blas_dcopy(lstm->y, t);
+	gsl_blas_dcopy(&step->y, t);
 	
 	gsl_blas_daxpy(-1, y, t); // lstm->y = lstm->y - y (predicted - target)
 	mul_vector(t, 2, t); // lstm->y = 2 * lstm->y
@@ -105,92 +520,75 @@ void bp_dEdh(LSTM *lstm, gsl_vector *y, gsl_vector *out) {
 	gsl_vector_free(t);
 }
 
-void bp_dhdc(LSTM *lstm, gsl_vector *out) {
-	gsl_vector *t = gsl_vector_calloc(lstm->hidden_dim);
-	sech_vector(lstm->c, t); // sech(c)
-	hdm_vector(t, t, t); // sech^2(c)
+void bp_dhdc(BP_STEP *step, gsl_vector *out) {
+	tanh_vector(&step->c, out); // out = tanh(c)
 
-	hdm_vector(lstm->o, t, out); // out = o * sech^2(c)
-		
-	gsl_vector_free(t);
+	for (int k = 0; k < (int)out->size; k++) {
+		double tc = gsl_vector_get(out, k);
+		gsl_vector_set(out, k, gsl_vector_get(&step->o, k) * (1 - tc * tc)); // out = o * sech^2(c) = o * (1 - tanh^2(c))
+	}
 }
 
-void bp_dhdo(LSTM *lstm, gsl_vector *out) {
-	sigmoid_vector(lstm->c, out); // out = sigmoid(c)
+void bp_dhdo(BP_STEP *step, gsl_vector *out) {
+	tanh_vector(&step->c, out); // out = tanh(c), since h = o * tanh(c)
 }
 
-void bp_dEdf(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out) {
-	gsl_vector *t1 = gsl_vector_calloc(lstm->hidden_dim);	
-	gsl_vector *t2 = gsl_vector_calloc(lstm->hidden_dim);
-
-	bp_X(FORGET, lstm, t1); // calculate X
-	sigmoid_vector(t1, t1); // t1 = sigmoid(X)
-	add_vector(-1, t1, 1, t2); // t2 = 1 - sigmoid(X)
-	hdm_vector(t1, t2, t2); // t2 = sigmoid(X) * (1 - sigmoid(X))
+// the gate derivatives below read the gate values f, i, o, ca of the timestep from the tape, so they don't redo the W * x and U * hp products:
+// g = sigmoid(X) -> dg/dX = g * (1 - g), ca = tanh(X) -> dca/dX = 1 - ca^2
 
-	hdm_vector(t2, lstm->cp, t2);
-	hdm_vector(t2, dEdc, t2);
-	gsl_blas_dcopy(t2, out);
-
-	gsl_vector_free(t1);
-	gsl_vector_free(t2);
+void bp_dEdf(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out) {
+	for (int k = 0; k < lstm->hidden_dim; k++) {
+		double f = gsl_vector_get(&step->f, k);
+		gsl_vector_set(out, k, gsl_vector_get(dEdc, k) * gsl_vector_get(&step->cp, k) * f * (1 - f)); // dE/dc * dc/df * df/dX
+	}
 }
 
-void bp_dEdi(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out) {
-	gsl_vector *t1 = gsl_vector_calloc(lstm->hidden_dim);	
-	gsl_vector *t2 = gsl_vector_calloc(lstm->hidden_dim);
-
-	bp_X(INPUT, lstm, t1); // calculate X
-	sigmoid_vector(t1, t1); // t1 = sigmoid(X)
-	add_vector(-1, t1, 1, t2); // t2 = 1 - sigmoid(X)
-	hdm_vector(t1, t2, t2); // t2 = sigmoid(X) * (1 - sigmoid(X))
-
-	hdm_vector(t2, lstm->ca, t2);
-	hdm_vector(t2, dEdc, t2);
-	gsl_blas_dcopy(t2, out);
-
-	gsl_vector_free(t1);
-	gsl_vector_free(t2);
+void bp_dEdi(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out) {
+	for (int k = 0; k < lstm->hidden_dim; k++) {
+		double i = gsl_vector_get(&step->i, k);
+		gsl_vector_set(out, k, gsl_vector_get(dEdc, k) * gsl_vector_get(&step->ca, k) * i * (1 - i)); // dE/dc * dc/di * di/dX
+	}
 }
 
-void bp_dEdca(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out) {
-	gsl_vector *t1 = gsl_vector_calloc(lstm->hidden_dim);	
-	gsl_vector *t2 = gsl_vector_calloc(lstm->hidden_dim);
-
-	bp_X(CAND, lstm, t1); // calculate X
-	sech_vector(t1, t1); // t1 = sech(X)
-	hdm_vector(t1, t1, t1); // t1 = sech^2(X)
-	add_vector(-1, t1, 1, t2); // t2 = 1 - sech^2(X)
+void bp_dEdca(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out) {
+	for (int k = 0; k < lstm->hidden_dim; k++) {
+		double ca = gsl_vector_get(&step->ca, k);
+		gsl_vector_set(out, k, gsl_vector_get(dEdc, k) * gsl_vector_get(&step->i, k) * (1 - ca * ca)); // dE/dc * dc/dca * dca/dX
+	}
+}
 
-	hdm_vector(t2, lstm->i, t2);
-	hdm_vector(t2, dEdc, t2);
-	gsl_blas_dcopy(t2, out);
+void bp_dEdo(LSTM *lstm, BP_STEP *step, gsl_vector *dEdh, gsl_vector *out) {
+	bp_dhdo(step, out); // out = dh/do
 
-	gsl_vector_free(t1);
-	gsl_vector_free(t2);
+	for (int k = 0; k < lstm->hidden_dim; k++) {
+		double o = gsl_vector_get(&step->o, k);
+		gsl_vector_set(out, k, gsl_vector_get(dEdh, k) * gsl_vector_get(out, k) * o * (1 - o)); // dE/dh * dh/do * do/dX
+	}
 }
 
-void bp_tdEdc(int t, LSTM_L *list, gsl_vector **series, gsl_vector *out) {
-	int hidden_dim = list->data[0]->hidden_dim;
+void bp_tdEdc(int t, LSTM *lstm, BP_TAPE *tape, gsl_vector **series, gsl_vector *out) {
+	int hidden_dim = tape->hidden_dim;
 	gsl_vector *res = gsl_vector_calloc(hidden_dim);
 
 	int i2 = 0;
 
-	for (int i = t; i < list->size; i++) {
+	for (int i = t; i < tape->n; i++) {
 		// STEP 1:
 		// calculate gradient flowing from hidden state h -> cell state c at timestep t
 		// dE/dct = dE/dht * dh/dct
 
 		gsl_vector *t1 = gsl_vector_calloc(hidden_dim);
 		gsl_vector *t2 = gsl_vector_calloc(hidden_dim);
-		bp_dEdh(lstml_get(list, i), series[i], t1); // t1 = dEt/dht
-		bp_dhdc(lstml_get(list, i), t2); // t2 = dht/dct
+		BP_STEP step = bp_tape_step(tape, i);
+		bp_dEdh(lstm, &step, series[i], t1); // t1 = dEt/dht
+		bp_dhdc(&step, t2); // t2 = dht/dct
 		hdm_vector(t1, t2, t1); // t1 = dEt/dht * dht/dct
 
 		// STEP 2:
 		// calculate gradient flowing from future cell states c(t+x) -> current cell state c(t)
 		for (int j = 0; j < i2; j++) {
-			hdm_vector(t1, lstml_get(list, i + j + 1)->f, t1);
+			BP_STEP future = bp_tape_step(tape, t + j + 1); // dc(i)/dc(t) = f(t+1) * ... * f(i)
+			hdm_vector(t1, &future.f, t1);
 		}
 
 		gsl_blas_daxpy(1, t1, res);
@@ -205,8 +603,16 @@ void bp_tdEdc(int t, LSTM_L *list, gsl_vector **series, gsl_vector *out) {
 	gsl_vector_free(res);
 }
 
+// y = y + a * x, one row at a time (the gate matrices are views into wp, so their rows aren't contiguous with each other)
+static void axpy_matrix(double a, gsl_matrix *x, gsl_matrix *y) {
+	for (int r = 0; r < (int)y->size1; r++) {
+		gsl_vector_view xr = gsl_matrix_row(x, r);
+		gsl_vector_view yr = gsl_matrix_row(y, r);
+		gsl_blas_daxpy(a, &xr.vector, &yr.vector);
+	}
+}
+
 void bp_lWg(BP_GATES gate, LSTM *lstm, gsl_matrix *p) {
-	gsl_matrix *t1 = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
 	gsl_matrix **t2;
 	switch(gate) {
 		case INPUT:
@@ -223,11 +629,12 @@ void bp_lWg(BP_GATES gate, LSTM *lstm, gsl_matrix *p) {
 		break;
 	}
 
-	add_matrix(*t2, 1, p, -learning_rate, 0, *t2);
+	INSTR_BEGIN(INSTR_UPDATE);
+	axpy_matrix(-learning_rate, p, *t2);
+	INSTR_END(INSTR_UPDATE, 2 * p->size1 * p->size2, 0);
 }
 
 void bp_lUg(BP_GATES gate, LSTM *lstm, gsl_matrix *p) {
-	gsl_matrix *t1 = gsl_matrix_calloc(lstm->hidden_dim, lstm->hidden_dim);
 	gsl_matrix **t2;
 	switch(gate) {
 		case INPUT:
@@ -244,11 +651,12 @@ void bp_lUg(BP_GATES gate, LSTM *lstm, gsl_matrix *p) {
 		break;
 	}
 
-	add_matrix(*t2, 1, p, -learning_rate, 0, *t2);
+	INSTR_BEGIN(INSTR_UPDATE);
+	axpy_matrix(-learning_rate, p, *t2);
+	INSTR_END(INSTR_UPDATE, 2 * p->size1 * p->size2, 0);
 }
 
 void bp_lbg(BP_GATES gate, LSTM *lstm, gsl_vector *p) {
-	gsl_vector *t1 = gsl_vector_calloc(lstm->hidden_dim);
 	gsl_vector **t2;
 	switch(gate) {
 		case INPUT:
@@ -265,34 +673,65 @@ void bp_lbg(BP_GATES gate, LSTM *lstm, gsl_vector *p) {
 		break;
 	}
 
+	INSTR_BEGIN(INSTR_UPDATE);
 	gsl_blas_daxpy(-learning_rate, p, *t2);
+	INSTR_END(INSTR_UPDATE, 2 * p->size, 0);
+}
+
+void bp_learn_gates_cxt(LSTM *lstm, BCKPROP_CXT *cxt) {
+	gsl_matrix *dW[4] = {cxt->dEdWi, cxt->dEdWo, cxt->dEdWf, cxt->dEdWc};
+	gsl_matrix *dU[4] = {cxt->dEdUi, cxt->dEdUo, cxt->dEdUf, cxt->dEdUc};
+	gsl_vector *db[4] = {cxt->dEdbi, cxt->dEdbo, cxt->dEdbf, cxt->dEdbc};
+	BP_GATES gates[4] = {INPUT, OUTPUT, FORGET, CAND};
+
+	for (int k = 0; k < 4; k++) {
+		bp_lWg(gates[k], lstm, dW[k]);
+		bp_lUg(gates[k], lstm, dU[k]);
+		bp_lbg(gates[k], lstm, db[k]);
+	}
+
+	// the output layer has no bp_l* function
+	INSTR_BEGIN(INSTR_UPDATE);
+	axpy_matrix(-learning_rate, cxt->dEdWy, lstm->wy);
+	gsl_blas_daxpy(-learning_rate, cxt->dEdby, lstm->by);
+	INSTR_END(INSTR_UPDATE, 2 * (lstm->wy->size1 * lstm->wy->size2 + lstm->by->size), 0);
 }
 
 BCKPROP_CXT *bp_create_cxt(LSTM *lstm) {
-	// allocate different matrix and vector gradients
+	int input_dim = lstm->input_dim;
+	int hidden_dim = lstm->hidden_dim;
+
+	// allocate the packed gradients, then point the per gate gradients into them (same layout as create_lstm)
 	BCKPROP_CXT *backprop_context = (BCKPROP_CXT *)malloc(sizeof(BCKPROP_CXT));
+	if (backprop_context == NULL) printf("ERROR: FAILED TO ALLOCATE BACKPROP CONTEXT!\n");
 
-	backprop_context->dEdWf = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
-	backprop_context->dEdUf = gsl_matrix_calloc(lstm->hidden_dim, lstm->hidden_dim);
-	backprop_context->dEdbf = gsl_vector_calloc(lstm->hidden_dim);
+	backprop_context->E = 0;
+	backprop_context->dEdWp = gsl_matrix_calloc(4 * hidden_dim, input_dim + hidden_dim);
+	backprop_context->dEdbp = gsl_vector_calloc(4 * hidden_dim);
+	backprop_context->dEdWy = gsl_matrix_calloc(lstm->output_dim, hidden_dim);
+	backprop_context->dEdby = gsl_vector_calloc(lstm->output_dim);
 
-	backprop_context->dEdWi = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
-	backprop_context->dEdUi = gsl_matrix_calloc(lstm->hidden_dim, lstm->hidden_dim);
-	backprop_context->dEdbi = gsl_vector_calloc(lstm->hidden_dim);
+	backprop_context->dEdWf = create_submatrix_view(backprop_context->dEdWp, 0, 0, hidden_dim, input_dim);
+	backprop_context->dEdUf = create_submatrix_view(backprop_context->dEdWp, 0, input_dim, hidden_dim, hidden_dim);
+	backprop_context->dEdbf = create_subvector_view(backprop_context->dEdbp, 0, hidden_dim);
 
-	backprop_context->dEdWo = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
-	backprop_context->dEdUo = gsl_matrix_calloc(lstm->hidden_dim, lstm->hidden_dim);
-	backprop_context->dEdbo = gsl_vector_calloc(lstm->hidden_dim);
+	backprop_context->dEdWi = create_submatrix_view(backprop_context->dEdWp, hidden_dim, 0, hidden_dim, input_dim);
+	backprop_context->dEdUi = create_submatrix_view(backprop_context->dEdWp, hidden_dim, input_dim, hidden_dim, hidden_dim);
+	backprop_context->dEdbi = create_subvector_view(backprop_context->dEdbp, hidden_dim, hidden_dim);
 
-	backprop_context->dEdWc = gsl_matrix_calloc(lstm->hidden_dim, lstm->input_dim);
-	backprop_context->dEdUc = gsl_matrix_calloc(lstm->hidden_dim, lstm->hidden_dim);
-	backprop_context->dEdbc = gsl_vector_calloc(lstm->hidden_dim);
+	backprop_context->dEdWo = create_submatrix_view(backprop_context->dEdWp, 2 * hidden_dim, 0, hidden_dim, input_dim);
+	backprop_context->dEdUo = create_submatrix_view(backprop_context->dEdWp, 2 * hidden_dim, input_dim, hidden_dim, hidden_dim);
+	backprop_context->dEdbo = create_subvector_view(backprop_context->dEdbp, 2 * hidden_dim, hidden_dim);
+
+	backprop_context->dEdWc = create_submatrix_view(backprop_context->dEdWp, 3 * hidden_dim, 0, hidden_dim, input_dim);
+	backprop_context->dEdUc = create_submatrix_view(backprop_context->dEdWp, 3 * hidden_dim, input_dim, hidden_dim, hidden_dim);
+	backprop_context->dEdbc = create_subvector_view(backprop_context->dEdbp, 3 * hidden_dim, hidden_dim);
 
 	return backprop_context;
 }
 
 void bp_delete_cxt(BCKPROP_CXT *cxt) {
-	// free all resources from backprop context
+	// free all resources from backprop context, the per gate gradients are views so this only frees their structs
 	gsl_matrix_free(cxt->dEdWf);
 	gsl_matrix_free(cxt->dEdUf);
 	gsl_vector_free(cxt->dEdbf);
@@ -308,6 +747,35 @@ void bp_delete_cxt(BCKPROP_CXT *cxt) {
 	gsl_matrix_free(cxt->dEdWc);
 	gsl_matrix_free(cxt->dEdUc);
 	gsl_vector_free(cxt->dEdbc);
+
+	gsl_matrix_free(cxt->dEdWp);
+	gsl_vector_free(cxt->dEdbp);
+	gsl_matrix_free(cxt->dEdWy);
+	gsl_vector_free(cxt->dEdby);
 	
 	free(cxt);
 }
+
+void bp_add_cxt(BCKPROP_CXT *cxt, BCKPROP_CXT *other) {
+	cxt->E += other->E;
+	gsl_matrix_add(cxt->dEdWp, other->dEdWp);
+	gsl_vector_add(cxt->dEdbp, other->dEdbp);
+	gsl_matrix_add(cxt->dEdWy, other->dEdWy);
+	gsl_vector_add(cxt->dEdby, other->dEdby);
+}
+
+void bp_scale_cxt(BCKPROP_CXT *cxt, double a) {
+	cxt->E *= a;
+	gsl_matrix_scale(cxt->dEdWp, a);
+	gsl_vector_scale(cxt->dEdbp, a);
+	gsl_matrix_scale(cxt->dEdWy, a);
+	gsl_vector_scale(cxt->dEdby, a);
+}
+
+void bp_zero_cxt(BCKPROP_CXT *cxt) {
+	cxt->E = 0;
+	gsl_matrix_set_zero(cxt->dEdWp);
+	gsl_vector_set_zero(cxt->dEdbp);
+	gsl_matrix_set_zero(cxt->dEdWy);
+	gsl_vector_set_zero(cxt->dEdby);
+}
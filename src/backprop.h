@@ -9,7 +9,7 @@
 // Output of LSTM (Not to be confused with output gate!): y = Wy * ht + by (Wy -> weight of output, ht -> hidden state of lstm at timestep t, by -> bias of output)
 // dsigmoid/dx = sigmoid(x) * (1 - sigmoid(x))
 // dE/dh = 2(lstm->y - y) * Wy
-// dh/do = sigmoid(c)
+// dh/do = tanh(c)
 // dh/dc = o * sech^2(c)
 // dE/dW(gate) = dE/dh * dh/dc * dc/d(gate) * d(gate)/dW(gate) (only applies to forget, input/update and candidate gates).
 //
@@ -41,6 +41,9 @@
 //
 // recurrence form:
 // dE/dct = dE/dht * ot(sech^2(ct)) + f(t+1) * dE/dc(t+1)
+// ht is also an input of every gate at t+1 (through U), so dE/dht has a recurrent term as well:
+// dE/dht = 2(yt - targett) * Wy + U^T * dE/dX(t+1), where U = [Uf; Ui; Uo; Uc] and X = [Xf; Xi; Xo; Xca] (the packed gate order of lstm.h)
+// bp_bwdpass walks the tape once from the last timestep to the first, carrying dE/dh(t+1) and dE/dc(t+1), so a whole series costs O(T).
 //
 // note: the p after the variable names denotes the previous state of the variables, i.e: cp = c(t-1) where t-> time
 
@@ -51,7 +54,17 @@ typedef enum {INPUT, OUTPUT, FORGET, CAND} BP_GATES;
 typedef enum {W, U, b} BP_PARA;
 
 // a struct for the "context" of our backpropagation algorithm, it stores values like total error, total gradient loss wrt all parameters of the lstm, etc.
+// the gate gradients are packed exactly like the lstm weights (see lstm.h): dEdWp has the layout of wp and dEdbp the layout of bp.
+// dEdWf, dEdUf, ..., dEdbc are views into dEdWp/dEdbp, so the backward pass accumulates all four gates with one outer product per timestep.
 typedef struct {   
+	double E; // total loss over the series
+
+	gsl_matrix *dEdWp; // 4 * hidden_dim x (input_dim + hidden_dim)
+	gsl_vector *dEdbp; // 4 * hidden_dim
+
+	gsl_matrix *dEdWy; // gradient loss wrt the weights of the output layer
+	gsl_vector *dEdby;
+
 	gsl_matrix *dEdWf;
 	gsl_matrix *dEdUf;
 	gsl_vector *dEdbf;
@@ -69,26 +82,104 @@ typedef struct {
 	gsl_vector *dEdbc;
 } BCKPROP_CXT;
 
+// activation tape: everything the backward pass needs from a forward pass over a series of n timesteps, in a single allocation.
+// timestep t is stored as one row of data, laid out like the packed vectors of the lstm: [x | hp | cp | f | i | o | ca | c | h | y]
+// so a row is input_dim + 8 * hidden_dim + output_dim doubles, and memory grows with n * hidden_dim instead of n * (number of parameters).
+typedef struct {
+	int n; // number of timesteps
+	int rows; // number of allocated timesteps (n <= rows)
+	int start; // row of timestep 0. timestep t is stored in row (start + t) % rows, so the rows can be used as a ring buffer
+	int input_dim;
+	int hidden_dim;
+	int output_dim;
+	int stride; // doubles per timestep
+	double data[]; // n * stride doubles
+} BP_TAPE;
+
+// view of one timestep of a tape, the vectors point into the tape's memory (nothing is copied).
+typedef struct {
+	gsl_vector x;
+	gsl_vector hp;
+	gsl_vector cp;
+	gsl_vector f;
+	gsl_vector i;
+	gsl_vector o;
+	gsl_vector ca;
+	gsl_vector c;
+	gsl_vector h;
+	gsl_vector y;
+} BP_STEP;
+
+// streaming trainer (truncated backpropagation through time) for series that never end, the samples are pushed one at a time.
+// every sample is the target of the previous timestep and the input of the next one, the activations of the last k1 timesteps are kept in a ring buffer tape.
+// every k2 samples, the last k1 timesteps are backpropagated and the weights updated. h and c carry over between windows, they're never reset.
+// memory and cost per sample don't depend on how long the stream runs. the activations in the ring were computed with the weights of their time,
+// so a window that spans an update mixes old and new weights (the usual approximation of truncated bptt).
+typedef struct {
+	LSTM *lstm;
+	int k1; // timesteps per backward pass
+	int k2; // samples between backward passes
+	long steps; // samples pushed so far
+	double E; // loss of the last window
+	BP_TAPE *tape; // ring of the last k1 + 1 timesteps
+	BCKPROP_CXT *cxt;
+	gsl_vector *tv; // k1 target views into the tape
+	gsl_vector **targets;
+	struct OPTIMIZER *opt; // optimizer for the updates (see optimizer.h), NULL = plain sgd with bp_learn_cxt
+} BP_STREAM;
+
+// tape functions
+size_t bp_tape_size(LSTM *lstm, int n); // size in bytes of a tape for n timesteps of lstm
+BP_TAPE *bp_create_tape(LSTM *lstm, int n); // create tape for n timesteps
+void bp_delete_tape(BP_TAPE *tape);
+void bp_tape_record(BP_TAPE *tape, int t, LSTM *lstm); // store the current vectors of lstm (after a forward pass) as timestep t
+BP_STEP bp_tape_step(BP_TAPE *tape, int t); // get timestep t of the tape
+
 // backprop context functions
 BCKPROP_CXT *bp_create_cxt(LSTM *lstm);
 void bp_delete_cxt(BCKPROP_CXT *cxt);
+void bp_zero_cxt(BCKPROP_CXT *cxt); // set the loss and all gradients to 0
+void bp_add_cxt(BCKPROP_CXT *cxt, BCKPROP_CXT *other); // cxt = cxt + other (loss and gradients), for combining the gradients of several workers
+void bp_scale_cxt(BCKPROP_CXT *cxt, double a); // cxt = a * cxt (loss and gradients)
+void bp_learn_cxt(LSTM *lstm, BCKPROP_CXT *cxt); // one plain sgd step (learning rate 0.001) on every parameter of lstm with the gradients of cxt. optimizer.h has the configurable optimizers
+void bp_learn_gates_cxt(LSTM *lstm, BCKPROP_CXT *cxt); // the same step as bp_learn_cxt, gate by gate through bp_lWg, bp_lUg and bp_lbg, then the output layer. used by the hogwild trainer
+
+// streaming trainer functions
+BP_STREAM *bp_create_stream(LSTM *lstm, int k1, int k2); // trainer for lstm (output_dim has to equal input_dim), backpropagates k1 timesteps every k2 samples. returns NULL if k1 or k2 is below 1
+void bp_delete_stream(BP_STREAM *stream); // frees the trainer, not the lstm
+int bp_stream_push(BP_STREAM *stream, gsl_vector *x); // consume the next sample of the stream, returns 1 if the weights were updated (the loss of the window is in stream->E)
 
 // backpropagate an lstm along a series of vectors (backpropagation through time)
+// the lstm is trained to predict the next element of the series: series[t] is the input of timestep t and series[t + 1] its target, so output_dim has to equal input_dim.
 // backpropagation works like this:
-// during forward pass, for each element in the series we clone the LSTM. And we store the all the calculated vectors inside that LSTM. We then move forward to the next element and keep repeating it until we reach the last element of the series.
-// we also store all the losses of each timestep into a list and sum them up.
-// we then start the backward pass. We go to the (n-1)th element and calculate gradients for it wrt each weight and bias
-void bp_series_lstm(LSTM* lstm, gsl_vector **series, int n);
+// during forward pass, for each element in the series we record all the calculated vectors of the LSTM into the activation tape. We then move forward to the next element and keep repeating it until we reach the last element of the series.
+// we also sum up the losses of each timestep.
+// we then start the backward pass. We go to the (n-1)th element and calculate gradients for it wrt each weight and bias, then move one element back, carrying dE/dh and dE/dc along.
+double bp_series_lstm(LSTM* lstm, gsl_vector **series, int n); // compute the gradients and take one gradient descent step, returns the loss before the step
+double bp_gradients_lstm(LSTM *lstm, gsl_vector **series, int n, BCKPROP_CXT *cxt); // compute the loss and the gradients of a series into cxt (cxt is zeroed first), returns the loss
+double bp_accumulate_lstm(LSTM *lstm, BP_TAPE *tape, gsl_vector **series, int n, BCKPROP_CXT *cxt); // like bp_gradients_lstm, but adds to cxt without zeroing it and records into tape (tape->rows >= n - 1) instead of allocating one. returns the loss of this series
+void bp_bwdpass(LSTM *lstm, BP_TAPE *tape, gsl_vector **targets, BCKPROP_CXT *cxt); // reverse sweep over a tape, adds the loss and the gradients to cxt. targets[t] = target output of timestep t
+// checkpointed backpropagation through time, for series too long to keep a tape of every timestep.
+// the forward sweep only keeps hp and cp every k timesteps. the backward sweep reruns the forward pass of one k timestep segment at a time from its checkpoint into a k row tape, and sweeps that.
+// memory: a tape of k timesteps + n / k checkpoints of 2 * hidden_dim doubles, instead of a tape of n timesteps. cost: one extra forward pass.
+// k = sqrt(n) minimizes the memory, k = n is the same as bp_gradients_lstm.
+double bp_gradients_ckpt_lstm(LSTM *lstm, gsl_vector **series, int n, int k, BCKPROP_CXT *cxt); // same result as bp_gradients_lstm, k <= 0 selects bp_ckpt_interval(n - 1)
+int bp_ckpt_interval(int n); // default checkpoint interval for n timesteps, ceil(sqrt(n))
+size_t bp_ckpt_size(LSTM *lstm, int n, int k); // bytes of activation memory bp_gradients_ckpt_lstm uses for n timesteps (compare with bp_tape_size)
+double bp_gradcheck_lstm(LSTM *lstm, gsl_vector **series, int n, double eps); // compare bp_gradients_lstm against central finite differences with step eps on every parameter, returns the largest relative error
+// the state of the lstm (hp, cp) is restored after every forward pass of bp_gradcheck_lstm, so it's left as it was before the call.
 
 // utility functions
-void bp_X(BP_GATES gate, LSTM *lstm, gsl_vector *out); // calculate X = Wx + Uhp + b
-LSTM_L *bp_fwdpass(LSTM *lstm, gsl_vector **series, int n); // do a forward pass, store all the variables of the unrolled lstm in list. length of series = n
+// in all the functions below, lstm only provides the weights. the vectors of a timestep (x, hp, c, ...) are read from step, a timestep of the activation tape.
+void bp_X(BP_GATES gate, LSTM *lstm, BP_STEP *step, gsl_vector *out); // calculate X = Wx + Uhp + b
+// NOTE: the backward pass doesn't need bp_X, the tape already stores the activated gates and the derivatives are computed from them.
+BP_TAPE *bp_fwdpass(LSTM *lstm, gsl_vector **series, int n); // do a forward pass, record all the variables of the unrolled lstm in a tape. length of series = n
 
 // gradient functions
-void bp_dEdh(LSTM *lstm, gsl_vector *y, gsl_vector *out); // compute gradient loss wrt hidden state.
+void bp_dEdh(LSTM *lstm, BP_STEP *step, gsl_vector *y, gsl_vector *out); // compute gradient loss wrt hidden state.
 // y = actual/target output
-void bp_dhdc(LSTM *lstm, gsl_vector *out); // compute gradient of hidden state wrt cell state.
-void bp_dhdo(LSTM *lstm, gsl_vector *out); // compute gradient of hidden state wrt output gate vector
+void bp_dhdc(BP_STEP *step, gsl_vector *out); // compute gradient of hidden state wrt cell state.
+void bp_dhdo(BP_STEP *step, gsl_vector *out); // compute gradient of hidden state wrt output gate vector
 
 // these functions don't take any arguments because they just use pre-existing variables inside the lstm as input!
 // compute gradients of g gate (input gate, output gate and forget gate)
@@ -102,17 +193,20 @@ void bp_dhdo(LSTM *lstm, gsl_vector *out); // compute gradient of hidden state w
 // void bp_dcadb(LSTM *lstm, gsl_vector *out);
 
 // these functions follow the formula: dE/df = dc/df * df/dX (where X = Wx + Uhp + b)
-void bp_dEdf(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt forget vector
-void bp_dEdi(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt input gate vector
-void bp_dEdca(LSTM *lstm, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt candidate gate vector
+// df/dX is computed from the gate value of the tape, f * (1 - f) for the sigmoid gates and 1 - ca^2 for the candidate gate, so they do no matrix work and allocate nothing.
+void bp_dEdf(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt forget vector
+void bp_dEdi(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt input gate vector
+void bp_dEdca(LSTM *lstm, BP_STEP *step, gsl_vector *dEdc, gsl_vector *out); // compute gradient of cell state wrt candidate gate vector
+void bp_dEdo(LSTM *lstm, BP_STEP *step, gsl_vector *dEdh, gsl_vector *out); // compute gradient of hidden state wrt output gate vector, dE/do = dE/dh * dh/do * do/dX
 
 // gradient loss wrt model parameters (W, U, and b)
 // the capital P here means what parameter we're calculating with respect to, it can be W - Weight, U - recurrent kernel weights, b - bias vectors
 void bp_dEdP(BP_GATES gate, BP_PARA para, LSTM *lstm, gsl_matrix *out); // calculate gradient loss wrt gate parameter.
 // i.e, bp_dEdP(FORGET, W, lstm, out); is equivalent to writing dE/dWf, which is the gradient loss wrt weight of forward gate
-void bp_tdEdc(int t, LSTM_L *list, gsl_vector **series, gsl_vector *out); // calculate dEdc (gradient loss wrt cell state at timestep t)
+void bp_tdEdc(int t, LSTM *lstm, BP_TAPE *tape, gsl_vector **series, gsl_vector *out); // calculate dEdc (gradient loss wrt cell state at timestep t)
+// NOTE: bp_tdEdc only follows the paths through the future cell states and costs O(T) per call, bp_bwdpass computes the complete dE/dc of every timestep in one sweep.
 
-// learning functions
+// learning functions, plain sgd on the parameters of one gate with a fixed learning rate of 0.001 (bp_learn_cxt and the optimizers of optimizer.h update all the parameters at once)
 void bp_lWg(BP_GATES gate, LSTM *lstm, gsl_matrix *p); // change the weight parameter of gate, i.e:
 // Wf = Wf - learning rate * dE/dWf (where vector p is dE/dWf)
 void bp_lUg(BP_GATES gate, LSTM *lstm, gsl_matrix *p); // change the recurrent weight parameter of gate, i.e:
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include "bidir.h"
+#include "backprop.h"
+#include "lstm.h"
+
+// run lstm over arr in the given direction from zero states, h of timestep t goes into row t of out from column col
+static void encode(LSTM *lstm, gsl_vector **arr, int n, int reverse, gsl_matrix *out, int col) {
+	gsl_vector_set_zero(lstm->hp);
+	gsl_vector_set_zero(lstm->cp);
+
+	for (int k = 0; k < n; k++) {
+		int t = reverse ? n - 1 - k : k;
+		forward_pass_n_lstm(lstm, &arr[t], 1);
+
+		gsl_vector_view row = gsl_matrix_subrow(out, t, col, lstm->hidden_dim);
+		gsl_blas_dcopy(lstm->h, &row.vector);
+	}
+}
+
+// one bp_series_lstm step from zero states
+static double train(LSTM *lstm, gsl_vector **series, int n) {
+	gsl_vector_set_zero(lstm->hp);
+	gsl_vector_set_zero(lstm->cp);
+	return bp_series_lstm(lstm, series, n);
+}
+
+static void *bwd_main(void *arg) {
+	BIDIR_LSTM *bidir = (BIDIR_LSTM *)arg;
+	long seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&bidir->lock);
+		while (bidir->job == seen && !bidir->quit) pthread_cond_wait(&bidir->start, &bidir->lock);
+		if (bidir->quit) {
+			pthread_mutex_unlock(&bidir->lock);
+			return NULL;
+		}
+		seen = bidir->job;
+		pthread_mutex_unlock(&bidir->lock);
+
+		if (bidir->type == BIDIR_FORWARD) encode(bidir->bwd, bidir->arr, bidir->n, 1, bidir->out, bidir->fwd->hidden_dim);
+		else bidir->E = train(bidir->bwd, bidir->rev, bidir->n);
+
+		pthread_mutex_lock(&bidir->lock);
+		bidir->busy = 0;
+		pthread_cond_signal(&bidir->done);
+		pthread_mutex_unlock(&bidir->lock);
+	}
+}
+
+// hand a job to the bwd thread
+static void post_job(BIDIR_LSTM *bidir, BIDIR_JOB type, gsl_vector **arr, int n, gsl_matrix *out) {
+	pthread_mutex_lock(&bidir->lock);
+	bidir->type = type;
+	bidir->arr = arr;
+	bidir->n = n;
+	bidir->out = out;
+	bidir->busy = 1;
+	bidir->job++;
+	pthread_cond_signal(&bidir->start);
+	pthread_mutex_unlock(&bidir->lock);
+}
+
+static void wait_job(BIDIR_LSTM *bidir) {
+	pthread_mutex_lock(&bidir->lock);
+	while (bidir->busy) pthread_cond_wait(&bidir->done, &bidir->lock);
+	pthread_mutex_unlock(&bidir->lock);
+}
+
+BIDIR_LSTM *create_bidir_lstm(LSTM *fwd, LSTM *bwd) {
+	BIDIR_LSTM *bidir = (BIDIR_LSTM *)malloc(sizeof(BIDIR_LSTM));
+	if (bidir == NULL) printf("ERROR: FAILED TO ALLOCATE BIDIRECTIONAL LSTM!\n");
+	if (fwd->input_dim != bwd->input_dim) printf("ERROR: BOTH DIRECTIONS NEED THE SAME INPUT_DIM!\n");
+
+	bidir->fwd = fwd;
+	bidir->bwd = bwd;
+	bidir->job = 0;
+	bidir->busy = 0;
+	bidir->quit = 0;
+	bidir->arr = NULL;
+	bidir->n = 0;
+	bidir->out = NULL;
+	bidir->rev = NULL;
+	bidir->rev_size = 0;
+	bidir->E = 0;
+
+	pthread_mutex_init(&bidir->lock, NULL);
+	pthread_cond_init(&bidir->start, NULL);
+	pthread_cond_init(&bidir->done, NULL);
+
+	if (pthread_create(&bidir->thread, NULL, bwd_main, bidir) != 0) printf("ERROR: FAILED TO START BIDIRECTIONAL LSTM THREAD!\n");
+
+	return bidir;
+}
+
+void free_bidir_lstm(BIDIR_LSTM *bidir) {
+	pthread_mutex_lock(&bidir->lock);
+	bidir->quit = 1;
+	pthread_cond_signal(&bidir->start);
+	pthread_mutex_unlock(&bidir->lock);
+	pthread_join(bidir->thread, NULL);
+
+	pthread_mutex_destroy(&bidir->lock);
+	pthread_cond_destroy(&bidir->start);
+	pthread_cond_destroy(&bidir->done);
+
+	free(bidir->rev);
+	free(bidir);
+}
+
+void forward_pass_bidir_lstm(BIDIR_LSTM *bidir, gsl_vector **arr, int n, gsl_matrix *out) {
+	if (out->size1 != (size_t)n || out->size2 != (size_t)(bidir->fwd->hidden_dim + bidir->bwd->hidden_dim)) {
+		printf("ERROR: OUTPUT MATRIX OF BIDIRECTIONAL LSTM HAS THE WRONG SIZE!\n");
+		return;
+	}
+
+	// both directions write their own columns of out
+	post_job(bidir, BIDIR_FORWARD, arr, n, out);
+	encode(bidir->fwd, arr, n, 0, out, 0);
+	wait_job(bidir);
+}
+
+double train_bidir_lstm(BIDIR_LSTM *bidir, gsl_vector **series, int n) {
+	if (bidir->rev_size < n) {
+		free(bidir->rev);
+		bidir->rev = (gsl_vector **)malloc(n * sizeof(gsl_vector *));
+		if (bidir->rev == NULL) printf("ERROR: FAILED TO ALLOCATE BIDIRECTIONAL LSTM!\n");
+		bidir->rev_size = n;
+	}
+	for (int t = 0; t < n; t++) bidir->rev[t] = series[n - 1 - t];
+
+	post_job(bidir, BIDIR_TRAIN, series, n, NULL);
+	double E = train(bidir->fwd, series, n);
+	wait_job(bidir);
+
+	return E + bidir->E;
+}
@@ -0,0 +1,44 @@
+#ifndef BIDIR_H
+#define BIDIR_H
+
+#include <pthread.h>
+#include "lstm.h"
+
+// bidirectional lstm made of two normal LSTMs: fwd reads the series from the first to the last timestep, bwd from the last to the first.
+// the directions don't depend on each other, so every call runs them at the same time: bwd on a thread of the BIDIR_LSTM (started once in create_bidir_lstm), fwd on the calling thread.
+// the encoding of timestep t is [h of fwd after timestep t; h of bwd after timestep t], one row of the output matrix.
+//
+// training reuses the bptt of backprop.h for each direction on its own objective: fwd predicts the next element of the series (like bp_series_lstm), bwd the previous one
+// (bp_series_lstm on the reversed series). both lstms need output_dim = input_dim for it.
+
+typedef enum {BIDIR_FORWARD, BIDIR_TRAIN} BIDIR_JOB;
+
+typedef struct {
+	LSTM *fwd;
+	LSTM *bwd;
+
+	pthread_t thread; // runs bwd
+	pthread_mutex_t lock;
+	pthread_cond_t start; // signalled when a job is posted
+	pthread_cond_t done; // signalled when bwd finished the job
+	long job; // number of jobs posted so far, the thread waits for it to change
+	int busy;
+	int quit;
+
+	// current job
+	BIDIR_JOB type;
+	gsl_vector **arr;
+	int n;
+	gsl_matrix *out;
+	gsl_vector **rev; // arr reversed (training), grown when a longer series comes
+	int rev_size;
+	double E; // loss of bwd (training)
+} BIDIR_LSTM;
+
+BIDIR_LSTM *create_bidir_lstm(LSTM *fwd, LSTM *bwd); // both directions must have the same input_dim
+void free_bidir_lstm(BIDIR_LSTM *bidir); // stops the thread, doesn't free the lstms
+void forward_pass_bidir_lstm(BIDIR_LSTM *bidir, gsl_vector **arr, int n, gsl_matrix *out); // encode a series of n vectors, both directions start from zero states.
+// out is n x (fwd->hidden_dim + bwd->hidden_dim), row t = [h fwd; h bwd] of timestep t
+double train_bidir_lstm(BIDIR_LSTM *bidir, gsl_vector **series, int n); // one gradient descent step for each direction on a series (from zero states), returns the sum of the losses of both directions before the step
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "instrument.h"
+
+static const char *phase_names[INSTR_PHASES] = {"gate", "cstate", "hstate", "output", "fwdpass", "bwdpass", "update"};
+
+int instr_enabled() {
+#ifdef LSTM_INSTRUMENT
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+const char *instr_phase_name(INSTR_PHASE phase) {
+	return phase >= 0 && phase < INSTR_PHASES ? phase_names[phase] : "?";
+}
+
+#ifdef LSTM_INSTRUMENT
+
+// block of counters of one thread, only its thread writes to it
+typedef struct INSTR_BLOCK {
+	INSTR_COUNTERS counters;
+	struct INSTR_BLOCK *next;
+} INSTR_BLOCK;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static INSTR_BLOCK *registry = NULL; // every block, newest first
+static int registered = 0;
+static _Thread_local INSTR_BLOCK *local = NULL;
+
+static INSTR_BLOCK *local_block() {
+	if (local != NULL) return local;
+
+	local = (INSTR_BLOCK *)calloc(1, sizeof(INSTR_BLOCK));
+	if (local == NULL) {
+		printf("ERROR: FAILED TO ALLOCATE INSTRUMENTATION COUNTERS!\n");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&registry_lock);
+	local->counters.thread = registered++;
+	local->next = registry;
+	registry = local;
+	pthread_mutex_unlock(&registry_lock);
+
+	return local;
+}
+
+long long instr_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the owner is the only writer, the relaxed stores only keep the snapshots of other threads from tearing
+static void add(long long *counter, long long value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void instr_add(INSTR_PHASE phase, long long ns, long long flops, long long bytes) {
+	INSTR_COUNTER *c = &local_block()->counters.phase[phase];
+	add(&c->calls, 1);
+	add(&c->ns, ns);
+	add(&c->flops, flops);
+	add(&c->bytes, bytes);
+}
+
+void instr_alloc(INSTR_PHASE phase, long long bytes) {
+	add(&local_block()->counters.phase[phase].bytes, bytes);
+}
+
+// out = counters of block (sum = 0) or out + counters of block (sum = 1)
+static void read_block(INSTR_BLOCK *block, INSTR_COUNTERS *out, int sum) {
+	for (int p = 0; p < INSTR_PHASES; p++) {
+		INSTR_COUNTER *c = &block->counters.phase[p];
+		INSTR_COUNTER *o = &out->phase[p];
+		if (!sum) memset(o, 0, sizeof(INSTR_COUNTER));
+		o->calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+		o->ns += __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+		o->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		o->flops += __atomic_load_n(&c->flops, __ATOMIC_RELAXED);
+	}
+	if (!sum) out->thread = block->counters.thread;
+}
+
+static void zero_block(INSTR_BLOCK *block) {
+	for (int p = 0; p < INSTR_PHASES; p++) {
+		INSTR_COUNTER *c = &block->counters.phase[p];
+		__atomic_store_n(&c->calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->flops, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void instr_snapshot(INSTR_COUNTERS *out) {
+	read_block(local_block(), out, 0);
+}
+
+void instr_snapshot_all(INSTR_COUNTERS *out) {
+	memset(out, 0, sizeof(INSTR_COUNTERS));
+	out->thread = -1;
+
+	pthread_mutex_lock(&registry_lock);
+	for (INSTR_BLOCK *b = registry; b != NULL; b = b->next) read_block(b, out, 1);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+int instr_snapshot_threads(INSTR_COUNTERS *out, int max) {
+	int n = 0;
+
+	pthread_mutex_lock(&registry_lock);
+	for (INSTR_BLOCK *b = registry; b != NULL && n < max; b = b->next) read_block(b, &out[n++], 0);
+	pthread_mutex_unlock(&registry_lock);
+
+	return n;
+}
+
+void instr_reset() {
+	zero_block(local_block());
+}
+
+void instr_reset_all() {
+	pthread_mutex_lock(&registry_lock);
+	for (INSTR_BLOCK *b = registry; b != NULL; b = b->next) zero_block(b);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+#else
+
+// without LSTM_INSTRUMENT nothing is ever counted
+
+void instr_snapshot(INSTR_COUNTERS *out) {
+	memset(out, 0, sizeof(INSTR_COUNTERS));
+}
+
+void instr_snapshot_all(INSTR_COUNTERS *out) {
+	memset(out, 0, sizeof(INSTR_COUNTERS));
+	out->thread = -1;
+}
+
+int instr_snapshot_threads(INSTR_COUNTERS *out, int max) {
+	(void)out;
+	(void)max;
+	return 0;
+}
+
+void instr_reset() {
+}
+
+void instr_reset_all() {
+}
+
+#endif
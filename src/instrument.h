@@ -0,0 +1,61 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+// optional instrumentation of the hot paths: calls, nanoseconds, bytes allocated and flops for each phase of the forward and backward passes.
+// it's compiled in only when LSTM_INSTRUMENT is defined (i.e make CFLAGS="-g -DLSTM_INSTRUMENT"), otherwise the INSTR_* macros expand to nothing and cost nothing.
+// the functions below exist in both builds (they return zeros without LSTM_INSTRUMENT), so monitoring code doesn't need the flag.
+//
+// every thread counts into its own block of counters (no locking, no shared cache lines on the hot path). a block is registered the first time a thread records something
+// and is kept after the thread ends, so instr_snapshot_all also covers finished workers. other threads read the counters while they change, so a snapshot of another thread is
+// only consistent per counter, and a reset from another thread can be lost by an update running at the same time.
+//
+// phases nest: bp_fwdpass runs forward passes which count their gates, states and outputs too. the flops are the multiply-adds of the matrix/vector products and the
+// element wise products (2 per multiply-add), activations aren't counted.
+
+typedef enum {
+	INSTR_GATE, // gate(...) and candidate_gate(...), and the packed gate product + activations of the fused forward pass
+	INSTR_CSTATE, // cstate_eq(...), and both state equations of the fused forward pass (they share one loop)
+	INSTR_HSTATE, // hstate_eq(...), only the per gate forward pass
+	INSTR_OUTPUT, // output_lstm(...)
+	INSTR_FWDPASS, // recording a series on an activation tape (bp_fwdpass and the other backprop entry points), bytes = tapes allocated
+	INSTR_BWDPASS, // reverse sweeps of the backward pass
+	INSTR_UPDATE, // bp_lWg, bp_lUg, bp_lbg and step_optimizer
+	INSTR_PHASES // number of phases
+} INSTR_PHASE;
+
+typedef struct {
+	long long calls;
+	long long ns;
+	long long bytes;
+	long long flops;
+} INSTR_COUNTER;
+
+typedef struct {
+	int thread; // number of the thread in the order they first recorded something, -1 for a sum over threads
+	INSTR_COUNTER phase[INSTR_PHASES];
+} INSTR_COUNTERS;
+
+#ifdef LSTM_INSTRUMENT
+long long instr_now(); // monotonic clock, ns
+void instr_add(INSTR_PHASE phase, long long ns, long long flops, long long bytes); // one call of phase for the calling thread
+void instr_alloc(INSTR_PHASE phase, long long bytes); // memory allocated for phase outside of a call of it
+
+// INSTR_BEGIN(phase) starts timing a call of phase in the current block, INSTR_END(phase, flops, bytes) records it
+#define INSTR_BEGIN(phase) long long instr_start_##phase = instr_now()
+#define INSTR_END(phase, flops, bytes) instr_add(phase, instr_now() - instr_start_##phase, (long long)(flops), (long long)(bytes))
+#define INSTR_ALLOC(phase, bytes) instr_alloc(phase, (long long)(bytes))
+#else
+#define INSTR_BEGIN(phase)
+#define INSTR_END(phase, flops, bytes)
+#define INSTR_ALLOC(phase, bytes)
+#endif
+
+int instr_enabled(); // 1 if the library was built with LSTM_INSTRUMENT
+const char *instr_phase_name(INSTR_PHASE phase);
+void instr_snapshot(INSTR_COUNTERS *out); // counters of the calling thread
+void instr_snapshot_all(INSTR_COUNTERS *out); // sum of the counters of every thread
+int instr_snapshot_threads(INSTR_COUNTERS *out, int max); // counters of each thread (up to max of them), returns the number of threads written
+void instr_reset(); // zero the counters of the calling thread
+void instr_reset_all(); // zero the counters of every thread
+
+#endif
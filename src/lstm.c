@@ -1,39 +1,51 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_cblas.h>
 #include "nutils.h"
+#include "vmath.h"
+#include "instrument.h"
 #include "lstm.h"
 
-void gate(gsl_matrix *wi, gsl_matrix *ui, gsl_vector *bi, gsl_vector *xi, gsl_vector *hi, gsl_vector *fo) {
-	// Formula used: sigmoid(wi * xi + ui * hi + bi)
-
-	int hidden_dim = hi->size;
+// double precision instance of the fused forward pass (project_gates_d, activate_gates_d, state_eqs_d, output_d, fused_step_d)
+#define REAL double
+#define VEC gsl_vector
+#define MAT gsl_matrix
+#define TMPL(name) name##_d
+#define CBLAS(name) cblas_d##name
+#define SIGMOID_ARRAY sigmoid_array
+#define TANH_ARRAY tanh_array
+#include "lstm_tmpl.h"
 
-	// Vector initialization
-	gsl_vector *wixi = gsl_vector_calloc(hidden_dim);
-	gsl_vector *uihi = gsl_vector_calloc(hidden_dim);
+int lstm_small_kernel = LSTM_SMALL_KERNEL;
 
-	// Matrix multiplication
-	gsl_blas_dgemv(CblasNoTrans, 1, wi, xi, 0, wixi);
-	gsl_blas_dgemv(CblasNoTrans, 1, ui, hi, 0, uihi);
+void gate(gsl_matrix *wi, gsl_matrix *ui, gsl_vector *bi, gsl_vector *xi, gsl_vector *hi, gsl_vector *fo) {
+	// Formula used: sigmoid(wi * xi + ui * hi + bi)
+	// the sum is accumulated directly in fo, so nothing is allocated (fo must not be the same vector as xi or hi)
+	INSTR_BEGIN(INSTR_GATE);
 
-	// Vector addition
-	gsl_blas_daxpy(1, wixi, uihi); // adding to uihi because it will be deleted anyway
-	gsl_blas_daxpy(1, bi, uihi);
+	// fo = bi + wi * xi + ui * hi
+	gsl_blas_dcopy(bi, fo);
+	gsl_blas_dgemv(CblasNoTrans, 1, wi, xi, 1, fo);
+	gsl_blas_dgemv(CblasNoTrans, 1, ui, hi, 1, fo);
 
 	// Final sigmoid result
-	sigmoid_vector(uihi, uihi);
-	gsl_blas_dcopy(uihi, fo);
+	sigmoid_vector(fo, fo);
 
-	// Memory safety steps
-	gsl_vector_free(wixi);
-	gsl_vector_free(uihi);
+	INSTR_END(INSTR_GATE, 2 * fo->size * (wi->size2 + ui->size2), 0);
 }
 
-// this function initializes matrices and vectors
-LSTM *create_lstm(int input_dim, int hidden_dim, int output_dim) {
+// builds an lstm around the given parameter blocks (wp, bp, wy, by), every other block and all the views are allocated here
+static LSTM *create_lstm_blocks(int input_dim, int hidden_dim, int output_dim, gsl_matrix *wp, gsl_vector *bp, gsl_matrix *wy, gsl_vector *by) {
 	// allocate lstm to heap
 	LSTM *lstm = (LSTM *)malloc(sizeof(LSTM));
 	if (lstm == NULL) printf("ERROR: FAILED TO ALLOCATE LSTM STRUCT!\n");
@@ -43,37 +55,47 @@ LSTM *create_lstm(int input_dim, int hidden_dim, int output_dim) {
 	lstm->hidden_dim = hidden_dim;
 	lstm->output_dim = output_dim;
 
-	// matrices
-	lstm->wf = gsl_matrix_calloc(hidden_dim, input_dim);
-	lstm->wi = gsl_matrix_calloc(hidden_dim, input_dim);
-	lstm->wo = gsl_matrix_calloc(hidden_dim, input_dim);
-	lstm->wc = gsl_matrix_calloc(hidden_dim, input_dim);
+	lstm->fused = 1;
+	lstm->map = NULL;
+	lstm->map_size = 0;
 
-	lstm->wy = gsl_matrix_calloc(output_dim, hidden_dim);
+	// packed blocks
+	lstm->wp = wp;
+	lstm->bp = bp;
+	lstm->xh = gsl_vector_calloc(input_dim + hidden_dim);
+	lstm->g = gsl_vector_calloc(4 * hidden_dim);
 
-	lstm->uf = gsl_matrix_calloc(hidden_dim, hidden_dim);
-	lstm->ui = gsl_matrix_calloc(hidden_dim, hidden_dim);
-	lstm->uo = gsl_matrix_calloc(hidden_dim, hidden_dim);
-	lstm->uc = gsl_matrix_calloc(hidden_dim, hidden_dim);
+	// matrices (views into wp)
+	lstm->wf = create_submatrix_view(lstm->wp, 0 * hidden_dim, 0, hidden_dim, input_dim);
+	lstm->wi = create_submatrix_view(lstm->wp, 1 * hidden_dim, 0, hidden_dim, input_dim);
+	lstm->wo = create_submatrix_view(lstm->wp, 2 * hidden_dim, 0, hidden_dim, input_dim);
+	lstm->wc = create_submatrix_view(lstm->wp, 3 * hidden_dim, 0, hidden_dim, input_dim);
 
-	// bias vectors
-	lstm->bf = gsl_vector_calloc(hidden_dim);
-	lstm->bi = gsl_vector_calloc(hidden_dim);
-	lstm->bo = gsl_vector_calloc(hidden_dim);
-	lstm->bc = gsl_vector_calloc(hidden_dim);
+	lstm->wy = wy;
 
-	lstm->by = gsl_vector_calloc(output_dim);
+	lstm->uf = create_submatrix_view(lstm->wp, 0 * hidden_dim, input_dim, hidden_dim, hidden_dim);
+	lstm->ui = create_submatrix_view(lstm->wp, 1 * hidden_dim, input_dim, hidden_dim, hidden_dim);
+	lstm->uo = create_submatrix_view(lstm->wp, 2 * hidden_dim, input_dim, hidden_dim, hidden_dim);
+	lstm->uc = create_submatrix_view(lstm->wp, 3 * hidden_dim, input_dim, hidden_dim, hidden_dim);
 
-	// input vectors
-	lstm->x = gsl_vector_calloc(input_dim);
-	lstm->hp = gsl_vector_calloc(hidden_dim);
+	// bias vectors (views into bp)
+	lstm->bf = create_subvector_view(lstm->bp, 0 * hidden_dim, hidden_dim);
+	lstm->bi = create_subvector_view(lstm->bp, 1 * hidden_dim, hidden_dim);
+	lstm->bo = create_subvector_view(lstm->bp, 2 * hidden_dim, hidden_dim);
+	lstm->bc = create_subvector_view(lstm->bp, 3 * hidden_dim, hidden_dim);
+
+	lstm->by = by;
+
+	// input vectors (x and hp are views into xh)
+	lstm->x = create_subvector_view(lstm->xh, 0, input_dim);
+	lstm->hp = create_subvector_view(lstm->xh, input_dim, hidden_dim);
 	lstm->cp = gsl_vector_calloc(hidden_dim);
 
-	// intermediate vectors
-	lstm->f = gsl_vector_calloc(hidden_dim);
-	lstm->i = gsl_vector_calloc(hidden_dim);
-	lstm->o = gsl_vector_calloc(hidden_dim);
-	lstm->ca = gsl_vector_calloc(hidden_dim);
+	// intermediate vectors (views into g)
+	lstm->f = create_subvector_view(lstm->g, 0 * hidden_dim, hidden_dim);
+	lstm->i = create_subvector_view(lstm->g, 1 * hidden_dim, hidden_dim);
+	lstm->o = create_subvector_view(lstm->g, 2 * hidden_dim, hidden_dim);
+	lstm->ca = create_subvector_view(lstm->g, 3 * hidden_dim, hidden_dim);
 
 	// output vectors
 	lstm->y = gsl_vector_calloc(output_dim);
@@ -83,8 +105,18 @@ LSTM *create_lstm(int input_dim, int hidden_dim, int output_dim) {
 	return lstm;
 }
 
+// this function initializes matrices and vectors
+LSTM *create_lstm(int input_dim, int hidden_dim, int output_dim) {
+	gsl_matrix *wp = gsl_matrix_calloc(4 * hidden_dim, input_dim + hidden_dim);
+	gsl_vector *bp = gsl_vector_calloc(4 * hidden_dim);
+	gsl_matrix *wy = gsl_matrix_calloc(output_dim, hidden_dim);
+	gsl_vector *by = gsl_vector_calloc(output_dim);
+
+	return create_lstm_blocks(input_dim, hidden_dim, output_dim, wp, bp, wy, by);
+}
+
 void free_lstm(LSTM* lstm) {	
-	// matrices
+	// matrices (the gate matrices, biases, x, hp and the gate vectors are views, so this only frees their structs)
 	gsl_matrix_free(lstm->wf);
 	gsl_matrix_free(lstm->wi);
 	gsl_matrix_free(lstm->wo);
@@ -121,6 +153,15 @@ void free_lstm(LSTM* lstm) {
 	gsl_vector_free(lstm->h);
 	gsl_vector_free(lstm->c);
 
+	// packed blocks
+	gsl_matrix_free(lstm->wp);
+	gsl_vector_free(lstm->bp);
+	gsl_vector_free(lstm->xh);
+	gsl_vector_free(lstm->g);
+
+	// a mapped lstm's parameter blocks are views into the file, so they were only freed as structs above
+	if (lstm->map != NULL) munmap(lstm->map, lstm->map_size);
+
 	// free lstm struct
 	free(lstm);
 }
@@ -226,38 +267,21 @@ void print_lstm(LSTM* lstm) {
 LSTM *clone_lstm(LSTM *lstm) {
 	LSTM *clone = create_lstm(lstm->input_dim, lstm->hidden_dim, lstm->output_dim);
 
-	// matrices
-	gsl_matrix_memcpy(clone->wf, lstm->wf);
-	gsl_matrix_memcpy(clone->wi, lstm->wi);
-	gsl_matrix_memcpy(clone->wo, lstm->wo);
-	gsl_matrix_memcpy(clone->wc, lstm->wc);
-
-	gsl_matrix_memcpy(clone->wy, lstm->wy);
-
-	gsl_matrix_memcpy(clone->uf, lstm->uf);
-	gsl_matrix_memcpy(clone->ui, lstm->ui);
-	gsl_matrix_memcpy(clone->uo, lstm->uo);
-	gsl_matrix_memcpy(clone->uc, lstm->uc);
+	clone->fused = lstm->fused;
 
-	// bias vectors
-	gsl_blas_dcopy(lstm->bf, clone->bf);
-	gsl_blas_dcopy(lstm->bi, clone->bi);
-	gsl_blas_dcopy(lstm->bo, clone->bo);
-	gsl_blas_dcopy(lstm->bc, clone->bc);
+	// packed blocks (these hold all the gate weights, biases, x, hp and the gate vectors)
+	gsl_matrix_memcpy(clone->wp, lstm->wp);
+	gsl_blas_dcopy(lstm->bp, clone->bp);
+	gsl_blas_dcopy(lstm->xh, clone->xh);
+	gsl_blas_dcopy(lstm->g, clone->g);
 
+	// output weight and bias
+	gsl_matrix_memcpy(clone->wy, lstm->wy);
 	gsl_blas_dcopy(lstm->by, clone->by);
 
-	// input vectors
-	gsl_blas_dcopy(lstm->x, clone->x);
-	gsl_blas_dcopy(lstm->hp, clone->hp);
+	// cell state input
 	gsl_blas_dcopy(lstm->cp, clone->cp);
 
-	// intermediate vectors
-	gsl_blas_dcopy(lstm->f, clone->f);
-	gsl_blas_dcopy(lstm->i, clone->i);
-	gsl_blas_dcopy(lstm->o, clone->o);
-	gsl_blas_dcopy(lstm->ca, clone->ca);
-
 	// output vectors
 	gsl_blas_dcopy(lstm->y, clone->y);
 	gsl_blas_dcopy(lstm->h, clone->h);
@@ -266,6 +290,248 @@ LSTM *clone_lstm(LSTM *lstm) {
 	return clone;
 }
 
+// model files (the format is described in lstm.h)
+
+static int host_little_endian() {
+	uint16_t x = 1;
+	return *(uint8_t *)&x == 1;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	for (int k = 0; k < 4; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+	for (int k = 0; k < 8; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	uint32_t v = 0;
+	for (int k = 0; k < 4; k++) v |= (uint32_t)p[k] << (8 * k);
+	return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t v = 0;
+	for (int k = 0; k < 8; k++) v |= (uint64_t)p[k] << (8 * k);
+	return v;
+}
+
+static void swap_doubles(double *v, size_t n) {
+	for (size_t k = 0; k < n; k++) {
+		unsigned char *b = (unsigned char *)&v[k];
+		for (int j = 0; j < 4; j++) {
+			unsigned char t = b[j];
+			b[j] = b[7 - j];
+			b[7 - j] = t;
+		}
+	}
+}
+
+// byte offsets of wp, bp, wy and by in a file for these dimensions, offsets[4] = size of the file
+static void file_layout(int input_dim, int hidden_dim, int output_dim, uint64_t offsets[5]) {
+	uint64_t sizes[4] = {
+		(uint64_t)4 * hidden_dim * (input_dim + hidden_dim),
+		(uint64_t)4 * hidden_dim,
+		(uint64_t)output_dim * hidden_dim,
+		(uint64_t)output_dim
+	};
+
+	uint64_t offset = LSTM_FILE_HEADER;
+	for (int b = 0; b < 4; b++) {
+		offsets[b] = offset;
+		offset += sizes[b] * sizeof(double);
+		offset = (offset + LSTM_FILE_ALIGN - 1) / LSTM_FILE_ALIGN * LSTM_FILE_ALIGN;
+	}
+	offsets[4] = offset;
+}
+
+// checks the header of a file of file_size bytes, fills dims (input, hidden, output) and the offsets of the blocks. returns 0 if the header is valid
+static int parse_header(const unsigned char *header, uint64_t file_size, int dims[3], uint64_t offsets[5], const char *path) {
+	if (file_size < LSTM_FILE_HEADER || memcmp(header, LSTM_FILE_MAGIC, 8) != 0) {
+		printf("ERROR: %s IS NOT AN LSTM FILE!\n", path);
+		return -1;
+	}
+	if (get_u32(header + 8) != LSTM_FILE_VERSION || get_u32(header + 24) != sizeof(double)) {
+		printf("ERROR: UNSUPPORTED VERSION OF LSTM FILE %s!\n", path);
+		return -1;
+	}
+
+	for (int k = 0; k < 3; k++) {
+		dims[k] = (int)get_u32(header + 12 + 4 * k);
+		if (dims[k] <= 0) {
+			printf("ERROR: INVALID DIMENSIONS IN LSTM FILE %s!\n", path);
+			return -1;
+		}
+	}
+
+	// the blocks have to be exactly where this version puts them
+	file_layout(dims[0], dims[1], dims[2], offsets);
+	for (int b = 0; b < 4; b++) {
+		if (get_u64(header + 32 + 8 * b) != offsets[b]) {
+			printf("ERROR: INVALID BLOCK OFFSETS IN LSTM FILE %s!\n", path);
+			return -1;
+		}
+	}
+	if (file_size < offsets[4]) {
+		printf("ERROR: LSTM FILE %s IS TRUNCATED!\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// write n doubles in little-endian byte order
+static int write_doubles(FILE *file, const double *v, size_t n) {
+	if (host_little_endian()) return fwrite(v, sizeof(double), n, file) == n ? 0 : -1;
+
+	for (size_t k = 0; k < n; k++) {
+		double t = v[k];
+		swap_doubles(&t, 1);
+		if (fwrite(&t, sizeof(double), 1, file) != 1) return -1;
+	}
+	return 0;
+}
+
+// write zeros up to byte offset
+static int pad_file(FILE *file, uint64_t *pos, uint64_t offset) {
+	static const unsigned char zeros[LSTM_FILE_ALIGN] = {0};
+	size_t n = offset - *pos;
+
+	*pos = offset;
+	return fwrite(zeros, 1, n, file) == n ? 0 : -1;
+}
+
+int save_lstm(LSTM *lstm, const char *path) {
+	uint64_t offsets[5];
+	file_layout(lstm->input_dim, lstm->hidden_dim, lstm->output_dim, offsets);
+
+	unsigned char header[LSTM_FILE_HEADER] = {0};
+	memcpy(header, LSTM_FILE_MAGIC, 8);
+	put_u32(header + 8, LSTM_FILE_VERSION);
+	put_u32(header + 12, lstm->input_dim);
+	put_u32(header + 16, lstm->hidden_dim);
+	put_u32(header + 20, lstm->output_dim);
+	put_u32(header + 24, sizeof(double));
+	for (int b = 0; b < 4; b++) put_u64(header + 32 + 8 * b, offsets[b]);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("ERROR: FAILED TO OPEN %s FOR WRITING!\n", path);
+		return -1;
+	}
+
+	int err = fwrite(header, 1, LSTM_FILE_HEADER, file) != LSTM_FILE_HEADER;
+	uint64_t pos = LSTM_FILE_HEADER;
+
+	// matrices are written row by row, so views with a tda work too
+	gsl_matrix *m[2] = {lstm->wp, lstm->wy};
+	gsl_vector *v[2] = {lstm->bp, lstm->by};
+	for (int b = 0; b < 4 && !err; b++) {
+		err |= pad_file(file, &pos, offsets[b]);
+		if (b % 2 == 0) {
+			gsl_matrix *w = m[b / 2];
+			for (int r = 0; r < (int)w->size1 && !err; r++) err |= write_doubles(file, w->data + r * w->tda, w->size2);
+			pos += (uint64_t)w->size1 * w->size2 * sizeof(double);
+		} else {
+			gsl_vector *bv = v[b / 2];
+			for (int k = 0; k < (int)bv->size && !err; k++) err |= write_doubles(file, bv->data + k * bv->stride, 1);
+			pos += (uint64_t)bv->size * sizeof(double);
+		}
+	}
+	if (!err) err |= pad_file(file, &pos, offsets[4]);
+
+	err |= fclose(file) != 0;
+	if (err) printf("ERROR: FAILED TO WRITE LSTM FILE %s!\n", path);
+	return err ? -1 : 0;
+}
+
+LSTM *load_lstm(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("ERROR: FAILED TO OPEN %s!\n", path);
+		return NULL;
+	}
+
+	unsigned char header[LSTM_FILE_HEADER] = {0};
+	size_t got = fread(header, 1, LSTM_FILE_HEADER, file);
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+
+	int dims[3];
+	uint64_t offsets[5];
+	if (got != LSTM_FILE_HEADER || parse_header(header, file_size, dims, offsets, path) != 0) {
+		fclose(file);
+		return NULL;
+	}
+
+	LSTM *lstm = create_lstm(dims[0], dims[1], dims[2]);
+
+	// the blocks of a new lstm are contiguous
+	double *data[4] = {lstm->wp->data, lstm->bp->data, lstm->wy->data, lstm->by->data};
+	size_t n[4] = {lstm->wp->size1 * lstm->wp->size2, lstm->bp->size, lstm->wy->size1 * lstm->wy->size2, lstm->by->size};
+	int err = 0;
+	for (int b = 0; b < 4 && !err; b++) {
+		err |= fseek(file, offsets[b], SEEK_SET) != 0;
+		err |= fread(data[b], sizeof(double), n[b], file) != n[b];
+		if (!host_little_endian()) swap_doubles(data[b], n[b]);
+	}
+	fclose(file);
+
+	if (err) {
+		printf("ERROR: FAILED TO READ LSTM FILE %s!\n", path);
+		free_lstm(lstm);
+		return NULL;
+	}
+	return lstm;
+}
+
+LSTM *map_lstm(const char *path) {
+	// the file is little-endian, a big-endian host can't use it in place
+	if (!host_little_endian()) return load_lstm(path);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: FAILED TO OPEN %s!\n", path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < LSTM_FILE_HEADER) {
+		printf("ERROR: %s IS NOT AN LSTM FILE!\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	// private mapping: processes share the page cache copy of the file, and writes (i.e training) go to private copies of the touched pages
+	size_t map_size = st.st_size;
+	unsigned char *map = (unsigned char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("ERROR: FAILED TO MAP %s!\n", path);
+		return NULL;
+	}
+
+	int dims[3];
+	uint64_t offsets[5];
+	if (parse_header(map, map_size, dims, offsets, path) != 0) {
+		munmap(map, map_size);
+		return NULL;
+	}
+
+	int input_dim = dims[0], hidden_dim = dims[1], output_dim = dims[2];
+	gsl_matrix *wp = create_array_matrix_view((double *)(map + offsets[0]), 4 * hidden_dim, input_dim + hidden_dim);
+	gsl_vector *bp = create_array_vector_view((double *)(map + offsets[1]), 4 * hidden_dim);
+	gsl_matrix *wy = create_array_matrix_view((double *)(map + offsets[2]), output_dim, hidden_dim);
+	gsl_vector *by = create_array_vector_view((double *)(map + offsets[3]), output_dim);
+
+	LSTM *lstm = create_lstm_blocks(input_dim, hidden_dim, output_dim, wp, bp, wy, by);
+	lstm->map = map;
+	lstm->map_size = map_size;
+
+	return lstm;
+}
+
 void forget_gate_lstm(LSTM *lstm) {
 	gate(lstm->wf, lstm->uf, lstm->bf, lstm->x, lstm->hp, lstm->f);
 }
@@ -281,28 +547,18 @@ void output_gate_lstm(LSTM *lstm) {
 // cell input activation vector gate
 void candidate_gate(gsl_matrix *wi, gsl_matrix *ui, gsl_vector *bi, gsl_vector *xi, gsl_vector *hi, gsl_vector *fo) {
 	// Formula used: tanh(wi * xi + ui * hi + bi)
+	// the sum is accumulated directly in fo, so nothing is allocated (fo must not be the same vector as xi or hi)
+	INSTR_BEGIN(INSTR_GATE);
 
-	int hidden_dim = hi->size;
-
-	// Vector initialization
-	gsl_vector *wixi = gsl_vector_calloc(hidden_dim);
-	gsl_vector *uihi = gsl_vector_calloc(hidden_dim);
-
-	// Matrix multiplication
-	gsl_blas_dgemv(CblasNoTrans, 1, wi, xi, 0, wixi);
-	gsl_blas_dgemv(CblasNoTrans, 1, ui, hi, 0, uihi);
-
-	// Vector addition
-	gsl_blas_daxpy(1, wixi, uihi); // adding to uihi because it will be deleted anyway
-	gsl_blas_daxpy(1, bi, uihi);
+	// fo = bi + wi * xi + ui * hi
+	gsl_blas_dcopy(bi, fo);
+	gsl_blas_dgemv(CblasNoTrans, 1, wi, xi, 1, fo);
+	gsl_blas_dgemv(CblasNoTrans, 1, ui, hi, 1, fo);
 
 	// Final tanh result
-	tanh_vector(uihi, uihi);
-	gsl_blas_dcopy(uihi, fo);
+	tanh_vector(fo, fo);
 
-	// Memory safety steps
-	gsl_vector_free(wixi);
-	gsl_vector_free(uihi);
+	INSTR_END(INSTR_GATE, 2 * fo->size * (wi->size2 + ui->size2), 0);
 }
 
 void candidate_gate_lstm(LSTM *lstm) {
@@ -311,43 +567,35 @@ void candidate_gate_lstm(LSTM *lstm) {
 
 void cstate_eq(gsl_vector *fi, gsl_vector *cpi, gsl_vector *ii, gsl_vector *cai, gsl_vector *co) {
 	// formula used: fi * cpi + ii * cai ( * = hadamard product)
-	// initialize vectors
-	gsl_vector *hdm1 = gsl_vector_calloc(fi->size);	
-	gsl_vector *hdm2 = gsl_vector_calloc(fi->size);	
-	
-	// hadarmard product of vectors
-	hdm_vector(fi, cpi, hdm1);
-	hdm_vector(ii, cai, hdm2);
-
-	// addition of vectors
-	gsl_blas_daxpy(1, hdm1, hdm2);
-
-	// copying into resultant vector
-	gsl_blas_dcopy(hdm2, co);
+	// computed element by element, so co can be any of the input vectors and no temporary vectors are needed
+	INSTR_BEGIN(INSTR_CSTATE);
+	int size = fi->size;
+
+	for (int k = 0; k < size; k++) {
+		double fc = gsl_vector_get(fi, k) * gsl_vector_get(cpi, k);
+		double ica = gsl_vector_get(ii, k) * gsl_vector_get(cai, k);
+		gsl_vector_set(co, k, fc + ica);
+	}
 
-	// memory safety steps
-	gsl_vector_free(hdm1);
-	gsl_vector_free(hdm2);
+	INSTR_END(INSTR_CSTATE, 3 * size, 0);
 }
 
 void hstate_eq(gsl_vector *oi, gsl_vector *ci, gsl_vector *ho) {
 	// formula used: oi * tanh(ci) ( * = hadamard product)
-	// initialize vectors
-	gsl_vector *v = gsl_vector_calloc(oi->size);
-	gsl_vector *s = gsl_vector_calloc(oi->size);
-
-	// tanh of vector
-	tanh_vector(ci, s);
-
-	// getting product
-	hdm_vector(oi, s, v);
-	
-	// copying over to resultant vector
-	gsl_blas_dcopy(v, ho);
+	// no temporary vectors are needed, tanh(ci) is stored in ho first unless that would overwrite oi
+	INSTR_BEGIN(INSTR_HSTATE);
+	int size = oi->size;
+
+	if (ho != oi) {
+		tanh_vector(ci, ho);
+		hdm_vector(oi, ho, ho);
+	} else {
+		for (int k = 0; k < size; k++) {
+			gsl_vector_set(ho, k, gsl_vector_get(oi, k) * tanh(gsl_vector_get(ci, k)));
+		}
+	}
 
-	// memory safety steps
-	gsl_vector_free(v);	
-	gsl_vector_free(s);
+	INSTR_END(INSTR_HSTATE, size, 0);
 }
 
 void cstate_eq_lstm(LSTM *lstm) {
@@ -360,12 +608,49 @@ void hstate_eq_lstm(LSTM *lstm) {
 
 void output_lstm(LSTM* lstm) {
 	// y = Wy*h + by
+	INSTR_BEGIN(INSTR_OUTPUT);
 	gsl_blas_dgemv(CblasNoTrans, 1, lstm->wy, lstm->h, 0, lstm->y);
-	gsl_blas_daxpy(1, lstm->y, lstm->by);
+	gsl_blas_daxpy(1, lstm->by, lstm->y);
+	INSTR_END(INSTR_OUTPUT, 2 * lstm->wy->size1 * lstm->wy->size2 + lstm->y->size, 0);
 }
 
+void fused_gates_lstm(LSTM *lstm) {
+	// Formula used: [f; i; o; ca] = [sigmoid; sigmoid; sigmoid; tanh](wp * [x; hp] + bp)
+	// x and hp are already stored next to each other in xh, and f, i, o, ca in g, so this is one matrix-vector product.
+	project_gates_d(lstm->wp, lstm->bp, lstm->xh, lstm->g);
+	activate_gates_d(lstm->g, lstm->hidden_dim);
+}
+
+
+// state view of the vectors of lstm (nothing is allocated or copied, only the vector structs)
+static LSTM_STATE state_view(LSTM *lstm) {
+	LSTM_STATE state;
+
+	state.input_dim = lstm->input_dim;
+	state.hidden_dim = lstm->hidden_dim;
+	state.output_dim = lstm->output_dim;
+
+	state.xh = *lstm->xh;
+	state.x = *lstm->x;
+	state.hp = *lstm->hp;
+	state.cp = *lstm->cp;
+	state.g = *lstm->g;
+	state.c = *lstm->c;
+	state.h = *lstm->h;
+	state.y = *lstm->y;
+
+	return state;
+}
 
 void forward_pass_lstm(LSTM *lstm) {
+	if (lstm->fused) {
+		// an lstm is a weight set and the state of one stream
+		LSTM_WEIGHTS weights = weights_lstm(lstm);
+		LSTM_STATE state = state_view(lstm);
+		forward_pass_state_lstm(&weights, &state);
+		return;
+	}
+
 	// calculate all equations
 	forget_gate_lstm(lstm);
 	input_gate_lstm(lstm);
@@ -387,6 +672,235 @@ void forward_pass_n_lstm(LSTM *lstm, gsl_vector **arr, int n) {
 	}	
 }
 
+LSTM_WEIGHTS weights_lstm(LSTM *lstm) {
+	LSTM_WEIGHTS weights;
+
+	weights.input_dim = lstm->input_dim;
+	weights.hidden_dim = lstm->hidden_dim;
+	weights.output_dim = lstm->output_dim;
+
+	weights.wp = lstm->wp;
+	weights.bp = lstm->bp;
+	weights.wy = lstm->wy;
+	weights.by = lstm->by;
+
+	return weights;
+}
+
+LSTM_STATE *create_state_lstm(const LSTM_WEIGHTS *weights) {
+	int input_dim = weights->input_dim;
+	int hidden_dim = weights->hidden_dim;
+	int output_dim = weights->output_dim;
+
+	// the struct and all the vectors are allocated together
+	size_t n = input_dim + 8 * hidden_dim + output_dim;
+	LSTM_STATE *state = (LSTM_STATE *)calloc(1, sizeof(LSTM_STATE) + n * sizeof(double));
+	if (state == NULL) printf("ERROR: FAILED TO ALLOCATE LSTM STATE!\n");
+
+	state->input_dim = input_dim;
+	state->hidden_dim = hidden_dim;
+	state->output_dim = output_dim;
+
+	// walk along the data: [x | hp | cp | f | i | o | ca | c | h | y]
+	double *p = state->data;
+	state->xh = gsl_vector_view_array(p, input_dim + hidden_dim).vector;
+	state->x = gsl_vector_view_array(p, input_dim).vector; p += input_dim;
+	state->hp = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	state->cp = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	state->g = gsl_vector_view_array(p, 4 * hidden_dim).vector; p += 4 * hidden_dim;
+	state->c = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	state->h = gsl_vector_view_array(p, hidden_dim).vector; p += hidden_dim;
+	state->y = gsl_vector_view_array(p, output_dim).vector;
+
+	return state;
+}
+
+void free_state_lstm(LSTM_STATE *state) {
+	free(state);
+}
+
+void reset_state_lstm(LSTM_STATE *state) {
+	memset(state->data, 0, (state->input_dim + 8 * state->hidden_dim + state->output_dim) * sizeof(double));
+}
+
+void forward_pass_state_lstm(const LSTM_WEIGHTS *weights, LSTM_STATE *state) {
+	// everything in one go, see lstm_tmpl.h
+	fused_step_d(weights->wp, weights->bp, weights->wy, weights->by, &state->xh, &state->g, &state->cp, &state->c, &state->h, &state->y);
+}
+
+void step_state_lstm(const LSTM_WEIGHTS *weights, LSTM_STATE *state, gsl_vector *x) {
+	gsl_blas_dcopy(x, &state->x);
+	forward_pass_state_lstm(weights, state);
+	gsl_blas_dcopy(&state->h, &state->hp);
+	gsl_blas_dcopy(&state->c, &state->cp);
+}
+
+LSTM_BATCH *create_batch_lstm(LSTM *lstm, int size) {
+	if (size < 1) {
+		printf("ERROR: LSTM BATCH NEEDS A SIZE OF AT LEAST 1!\n");
+		return NULL;
+	}
+
+	LSTM_BATCH *batch = (LSTM_BATCH *)malloc(sizeof(LSTM_BATCH));
+	if (batch == NULL) printf("ERROR: FAILED TO ALLOCATE LSTM BATCH STRUCT!\n");
+
+	int input_dim = lstm->input_dim;
+	int hidden_dim = lstm->hidden_dim;
+
+	batch->size = size;
+
+	// packed blocks
+	batch->xh = gsl_matrix_calloc(input_dim + hidden_dim, size);
+	batch->g = gsl_matrix_calloc(4 * hidden_dim, size);
+
+	// input matrices
+	batch->x = create_submatrix_view(batch->xh, 0, 0, input_dim, size);
+	batch->hp = create_submatrix_view(batch->xh, input_dim, 0, hidden_dim, size);
+	batch->cp = gsl_matrix_calloc(hidden_dim, size);
+
+	// intermediate matrices
+	batch->f = create_submatrix_view(batch->g, 0 * hidden_dim, 0, hidden_dim, size);
+	batch->i = create_submatrix_view(batch->g, 1 * hidden_dim, 0, hidden_dim, size);
+	batch->o = create_submatrix_view(batch->g, 2 * hidden_dim, 0, hidden_dim, size);
+	batch->ca = create_submatrix_view(batch->g, 3 * hidden_dim, 0, hidden_dim, size);
+
+	// output matrices
+	batch->y = gsl_matrix_calloc(lstm->output_dim, size);
+	batch->h = gsl_matrix_calloc(hidden_dim, size);
+	batch->c = gsl_matrix_calloc(hidden_dim, size);
+
+	return batch;
+}
+
+void free_batch_lstm(LSTM_BATCH *batch) {
+	// views
+	gsl_matrix_free(batch->x);
+	gsl_matrix_free(batch->hp);
+	gsl_matrix_free(batch->f);
+	gsl_matrix_free(batch->i);
+	gsl_matrix_free(batch->o);
+	gsl_matrix_free(batch->ca);
+
+	// matrices
+	gsl_matrix_free(batch->xh);
+	gsl_matrix_free(batch->g);
+	gsl_matrix_free(batch->cp);
+	gsl_matrix_free(batch->y);
+	gsl_matrix_free(batch->h);
+	gsl_matrix_free(batch->c);
+
+	free(batch);
+}
+
+// all the matrices of a batch span whole rows of their block, so their elements are contiguous and element-wise functions can treat them as one long vector
+static gsl_vector_view batch_vector(gsl_matrix *m) {
+	return gsl_vector_view_array(m->data, m->size1 * m->size2);
+}
+
+void forward_pass_step_batch_lstm(LSTM *lstm, LSTM_BATCH *batch) {
+	int hidden_dim = lstm->hidden_dim;
+
+	// gates: g = wp * xh + bp
+	for (int b = 0; b < batch->size; b++) {
+		gsl_matrix_set_col(batch->g, b, lstm->bp);
+	}
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, lstm->wp, batch->xh, 1, batch->g);
+
+	gsl_vector_view g = batch_vector(batch->g);
+	gsl_vector_view fio = gsl_vector_subvector(&g.vector, 0, 3 * hidden_dim * batch->size);
+	gsl_vector_view ca = batch_vector(batch->ca);
+	sigmoid_vector(&fio.vector, &fio.vector);
+	tanh_vector(&ca.vector, &ca.vector);
+
+	// cell and hidden states
+	gsl_vector_view f = batch_vector(batch->f);
+	gsl_vector_view i = batch_vector(batch->i);
+	gsl_vector_view o = batch_vector(batch->o);
+	gsl_vector_view cp = batch_vector(batch->cp);
+	gsl_vector_view c = batch_vector(batch->c);
+	gsl_vector_view h = batch_vector(batch->h);
+	cstate_eq(&f.vector, &cp.vector, &i.vector, &ca.vector, &c.vector);
+	hstate_eq(&o.vector, &c.vector, &h.vector);
+
+	// output: y = wy * h + by
+	for (int b = 0; b < batch->size; b++) {
+		gsl_matrix_set_col(batch->y, b, lstm->by);
+	}
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1, lstm->wy, batch->h, 1, batch->y);
+}
+
+LSTM_BATCH *forward_pass_batch_lstm(LSTM *lstm, gsl_vector ***batch, int B, int T) {
+	if (T < 0) {
+		printf("ERROR: LSTM BATCH SERIES CAN'T HAVE A NEGATIVE LENGTH!\n");
+		return NULL;
+	}
+
+	LSTM_BATCH *lb = create_batch_lstm(lstm, B);
+	if (lb == NULL) return NULL;
+
+	for (int t = 0; t < T; t++) {
+		// gather the inputs of timestep t into the columns of x
+		for (int b = 0; b < B; b++) {
+			gsl_matrix_set_col(lb->x, b, batch[b][t]);
+		}
+
+		forward_pass_step_batch_lstm(lstm, lb);
+		gsl_matrix_memcpy(lb->hp, lb->h);
+		gsl_matrix_memcpy(lb->cp, lb->c);
+	}
+
+	return lb;
+}
+
+void forward_pass_series_lstm(LSTM *lstm, gsl_vector **arr, int n) {
+	if (n <= 0) return;
+
+	int input_dim = lstm->input_dim;
+	int hidden_dim = lstm->hidden_dim;
+	int chunk = n < LSTM_SERIES_CHUNK ? n : LSTM_SERIES_CHUNK;
+
+	// wp split into its input part [wf; wi; wo; wc] and its recurrent part [uf; ui; uo; uc]
+	gsl_matrix_view w = gsl_matrix_submatrix(lstm->wp, 0, 0, 4 * hidden_dim, input_dim);
+	gsl_matrix_view u = gsl_matrix_submatrix(lstm->wp, 0, input_dim, 4 * hidden_dim, hidden_dim);
+
+	gsl_matrix *xs = gsl_matrix_alloc(chunk, input_dim); // inputs of a chunk, one timestep per row
+	gsl_matrix *ps = gsl_matrix_alloc(chunk, 4 * hidden_dim); // input projections w * x + bp of a chunk, one timestep per row
+
+	for (int t0 = 0; t0 < n; t0 += chunk) {
+		int len = (n - t0 < chunk) ? n - t0 : chunk;
+
+		// stack the inputs and project all of them at once: ps = xs * w^T + bp
+		for (int t = 0; t < len; t++) {
+			gsl_vector_view xrow = gsl_matrix_row(xs, t);
+			gsl_vector_view prow = gsl_matrix_row(ps, t);
+			gsl_blas_dcopy(arr[t0 + t], &xrow.vector);
+			gsl_blas_dcopy(lstm->bp, &prow.vector);
+		}
+
+		gsl_matrix_view xv = gsl_matrix_submatrix(xs, 0, 0, len, input_dim);
+		gsl_matrix_view pv = gsl_matrix_submatrix(ps, 0, 0, len, 4 * hidden_dim);
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1, &xv.matrix, &w.matrix, 1, &pv.matrix);
+
+		// recurrence, only u * hp is left to compute for each timestep
+		for (int t = 0; t < len; t++) {
+			gsl_vector_view prow = gsl_matrix_row(ps, t);
+
+			gsl_blas_dcopy(arr[t0 + t], lstm->x); // keeps x the same as after forward_pass_n_lstm
+			matvec_bias_d(&u.matrix, lstm->hp->data, prow.vector.data, lstm->g->data);
+			activate_gates_d(lstm->g, hidden_dim);
+
+			state_eqs_d(lstm->g, lstm->cp, lstm->c, lstm->h);
+			output_d(lstm->wy, lstm->by, lstm->h, lstm->y);
+
+			gsl_blas_dcopy(lstm->h, lstm->hp);
+			gsl_blas_dcopy(lstm->c, lstm->cp);
+		}
+	}
+
+	gsl_matrix_free(xs);
+	gsl_matrix_free(ps);
+}
+
 void input_vector_lstm(LSTM* lstm, gsl_vector *v) {
 	gsl_blas_dcopy(v, lstm->x);
 }
@@ -11,6 +11,8 @@
 // y = output vector (Wy * ht + by)
 //
 // In gate and other functions, which are used by the lstm and can be used by the user to test different equations i.e gate(...) and cstate_eq(...), the parameters for input have the suffix i and output have the suffix o.
+// None of these functions allocate memory: they write straight into their output parameter. All the memory a forward pass needs is owned by the LSTM (the packed xh and g vectors act as its workspace),
+// so forward_pass_lstm and forward_pass_n_lstm make no heap allocations. For gate(...) and candidate_gate(...), the output vector must not be one of the input vectors.
 //
 // range1, range2 = min, max. generally used for determining range of randomly generated values
 //
@@ -19,12 +21,28 @@
 // all variable notation in this struct is taken from https://en.wikipedia.org/wiki/Long_short-term_memory
 
 // NOTE: wc, uc, bc are weights and biases for the candidate gate
+//
+// Packed (fused) layout:
+// all gate parameters live in one matrix wp and one vector bp, stacked in the order forget, input, output, candidate:
+// wp = [wf uf; wi ui; wo uo; wc uc], size (4 * hidden_dim) x (input_dim + hidden_dim)
+// bp = [bf; bi; bo; bc], size 4 * hidden_dim
+// the input and gate vectors are packed the same way: xh = [x; hp] and g = [f; i; o; ca].
+// wf...uc, bf...bc, x, hp, f, i, o and ca are views into these blocks, so they can still be used like normal matrices/vectors.
+// this lets a forward pass compute all 4 gates with a single matrix-vector product: g = wp * xh + bp
 typedef struct {
 	// dimensions
 	int input_dim;
 	int output_dim;
 	int hidden_dim;
 
+	int fused; // if set (default), forward_pass_lstm computes all gates with one matrix-vector product over wp. otherwise each gate is computed separately.
+
+	// packed blocks (see above)
+	gsl_matrix *wp; // packed gate weights
+	gsl_vector *bp; // packed gate biases
+	gsl_vector *xh; // packed input vectors
+	gsl_vector *g; // packed gate vectors
+
 	// weight matrices
 	gsl_matrix *wf;
 	gsl_matrix *wi;
@@ -61,8 +79,91 @@ typedef struct {
 	gsl_vector *y;
 	gsl_vector *h;
 	gsl_vector *c;
+
+	// model file the parameters were mapped from by map_lstm (NULL otherwise). wp, bp, wy and by point into it
+	void *map;
+	size_t map_size;
 } LSTM;
 
+// struct for running a batch of B independent sequences through the same lstm at once.
+// every matrix holds one sequence per column, so a timestep for the whole batch costs one matrix-matrix product: g = wp * xh + bp (bp is added to every column)
+// the packing is the same as in the LSTM struct, x and hp are views into xh and f, i, o, ca are views into g.
+typedef struct {
+	int size; // batch size B (number of columns)
+
+	// packed blocks
+	gsl_matrix *xh; // (input_dim + hidden_dim) x B
+	gsl_matrix *g; // (4 * hidden_dim) x B
+
+	// input matrices
+	gsl_matrix *x; // input_dim x B
+	gsl_matrix *hp; // hidden_dim x B
+	gsl_matrix *cp; // hidden_dim x B
+
+	// intermediate matrices
+	gsl_matrix *f;
+	gsl_matrix *i;
+	gsl_matrix *o;
+	gsl_matrix *ca;
+
+	// output matrices
+	gsl_matrix *y; // output_dim x B
+	gsl_matrix *h; // hidden_dim x B
+	gsl_matrix *c; // hidden_dim x B
+} LSTM_BATCH;
+
+// an lstm split into its two halves, for running many independent streams (sessions) on one set of weights.
+// LSTM_WEIGHTS is a read-only view of the parameters (it doesn't own them, i.e they belong to an LSTM or a mapped model file),
+// LSTM_STATE holds everything one stream writes during a forward pass. forward_pass_state_lstm never writes to the weights,
+// so any number of threads can run their own states on the same weights without locking, and a stream costs O(input_dim + hidden_dim + output_dim) memory instead of a clone of the lstm.
+typedef struct {
+	int input_dim;
+	int hidden_dim;
+	int output_dim;
+
+	const gsl_matrix *wp; // packed gate weights, same layout as in LSTM
+	const gsl_vector *bp; // packed gate biases
+	const gsl_matrix *wy;
+	const gsl_vector *by;
+} LSTM_WEIGHTS;
+
+// the vectors point into data (one allocation per state), with the same packing as in LSTM: x and hp are views into xh, f, i, o and ca into g
+typedef struct {
+	int input_dim;
+	int hidden_dim;
+	int output_dim;
+
+	gsl_vector xh; // [x; hp]
+	gsl_vector x;
+	gsl_vector hp;
+	gsl_vector cp;
+	gsl_vector g; // [f; i; o; ca]
+	gsl_vector c;
+	gsl_vector h;
+	gsl_vector y;
+
+	double data[]; // xh | cp | g | c | h | y
+} LSTM_STATE;
+
+// number of timesteps forward_pass_series_lstm projects at once, this bounds its buffers to LSTM_SERIES_CHUNK * (input_dim + 4 * hidden_dim) doubles
+#define LSTM_SERIES_CHUNK 256
+
+// the fused forward pass computes the products of matrices with at most this many elements with its own register blocked kernel instead of blas (see lstm_tmpl.h).
+// 8192 = i.e hidden_dim 32 with input_dim up to 32 for the gates. lstm_small_kernel starts at this value and can be changed at runtime, 0 always uses blas
+#define LSTM_SMALL_KERNEL 8192
+extern int lstm_small_kernel;
+
+// model files (save_lstm, load_lstm, map_lstm):
+// all numbers are little-endian. the file starts with a header of LSTM_FILE_HEADER bytes:
+// bytes 0-7: LSTM_FILE_MAGIC, 8-11: version (LSTM_FILE_VERSION), 12-15: input_dim, 16-19: hidden_dim, 20-23: output_dim, 24-27: bytes per element (8, doubles), 28-31: 0
+// bytes 32-63: byte offsets of the blocks wp, bp, wy and by (8 bytes each)
+// the blocks follow in that order, each one starts at a multiple of LSTM_FILE_ALIGN bytes (the gap is zero filled) and is stored row by row without padding.
+// since wp and bp hold the parameters of all 4 gates, these 4 blocks are the whole model.
+#define LSTM_FILE_MAGIC "RLSTMBIN"
+#define LSTM_FILE_VERSION 1
+#define LSTM_FILE_HEADER 64
+#define LSTM_FILE_ALIGN 64
+
 // struct for storing list of lstms
 typedef struct {
 	int size; // length of list
@@ -84,11 +185,35 @@ LSTM *lstml_get(LSTM_L *list, int index); // get lstm at index of list
 LSTM *create_lstm(int input_dim, int hidden_dim, int output_dim); // (ONLY USE THESE FUNCTION FOR CREATING LSTMS) create lstm with all values initialized to 0;
 void forward_pass_lstm(LSTM *lstm); // does a forward pass
 void forward_pass_n_lstm(LSTM *lstm, gsl_vector **arr, int n); // does a forward pass on the same lstm n times. takes in an array of vectors as input, where each vector shows the change from the previous vector in a series. (arr length = n)
+void forward_pass_series_lstm(LSTM *lstm, gsl_vector **arr, int n); // same result as forward_pass_n_lstm, but the input projections (wf * x, wi * x, wo * x, wc * x) of all timesteps are computed up front with one matrix-matrix product per LSTM_SERIES_CHUNK timesteps,
+// so only the recurrent product (u * hp) is left on the sequential path. faster for long series, but allocates its buffers once per call.
 void free_lstm(LSTM* lstm); // delete lstm
 void print_lstm(LSTM* lstm); // print lstm's contents
 void input_vector_lstm(LSTM *lstm, gsl_vector *v); // input a vector into the lstm
 LSTM *clone_lstm(LSTM *lstm); // clone lstm
 
+// file functions
+int save_lstm(LSTM *lstm, const char *path); // write the parameters of lstm to a model file, returns 0 on success
+LSTM *load_lstm(const char *path); // create an lstm from a model file by reading it into memory, returns NULL on failure
+LSTM *map_lstm(const char *path); // create an lstm whose parameters point straight into the mmap'd model file (nothing is copied), returns NULL on failure.
+// the mapping is private: processes mapping the same file share one page cache copy of the parameters, and changing the parameters (i.e training) copies only the touched pages and never writes to the file.
+// free_lstm unmaps the file. on big-endian hosts map_lstm falls back to load_lstm.
+
+// weights/state functions
+LSTM_WEIGHTS weights_lstm(LSTM *lstm); // read-only view of the parameters of lstm (nothing is allocated, the view is valid as long as lstm is)
+LSTM_STATE *create_state_lstm(const LSTM_WEIGHTS *weights); // create a state for a stream, initialized to 0
+void free_state_lstm(LSTM_STATE *state);
+void reset_state_lstm(LSTM_STATE *state); // set the state back to 0, for starting a new sequence
+void forward_pass_state_lstm(const LSTM_WEIGHTS *weights, LSTM_STATE *state); // same as forward_pass_lstm: uses state->x, state->hp and state->cp as inputs and writes the rest of state
+void step_state_lstm(const LSTM_WEIGHTS *weights, LSTM_STATE *state, gsl_vector *x); // one timestep of a stream: input x, forward pass, then h and c become hp and cp (like forward_pass_n_lstm)
+
+// batch functions
+LSTM_BATCH *create_batch_lstm(LSTM *lstm, int size); // create a batch of size sequences for lstm, all states initialized to 0. returns NULL if size is below 1
+void free_batch_lstm(LSTM_BATCH *batch); // delete batch
+void forward_pass_step_batch_lstm(LSTM *lstm, LSTM_BATCH *batch); // does one forward pass (one timestep) for every sequence in the batch, uses batch->x, batch->hp and batch->cp as inputs
+LSTM_BATCH *forward_pass_batch_lstm(LSTM *lstm, gsl_vector ***batch, int B, int T); // does a forward pass over B series of T vectors each (batch[b] is a series like the one forward_pass_n_lstm takes). every series starts from zero hidden and cell states.
+// returns the batch holding the final states and outputs (column b = series b), free it with free_batch_lstm. NULL if B < 1 or T < 0
+
 // randomize functions
 void randomize_lstm(LSTM *lstm, double range1m, double range2m, double range1v, double range2v); // initialize LSTM with random values in a range. pre-requisite: all objects inside the struct should already be initialized.
 LSTM *create_rand_lstm(int input_dim, int hidden_dim, int output_dim, double range1m, double range2m, double range1v, double range2v); // create LSTM with random values. This creates objects within the struct too. (ONLY RANDOMIZES WEIGHTS AND BIASES!)
@@ -110,5 +235,6 @@ void candidate_gate_lstm(LSTM *lstm);
 void cstate_eq_lstm(LSTM *lstm);
 void hstate_eq_lstm(LSTM *lstm);
 void output_lstm(LSTM *lstm);
+void fused_gates_lstm(LSTM *lstm); // compute f, i, o and ca together: g = [sigmoid; sigmoid; sigmoid; tanh](wp * xh + bp)
 
 #endif
@@ -0,0 +1,100 @@
+#ifndef LSTM_FIXED_H
+#define LSTM_FIXED_H
+
+#include <stdio.h>
+#include <string.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "lstm.h"
+#include "vmath.h"
+
+// lstm cells with dimensions fixed at compile time, for hot loops where the sizes are known when building.
+// LSTM_FIXED_DEFINE(name, I, H, O) defines a struct type name holding all the weights and the state in fixed size arrays inside the struct (no heap, no gsl objects, no pointers),
+// and the functions working on it, with every loop bound a compile time constant so the compiler can unroll and vectorize them:
+//
+// int name##_import(name *cell, LSTM *lstm) - copy the weights, biases and hidden/cell states of lstm (dimensions must be I, H, O), returns 0 or -1 on mismatch
+// void name##_reset(name *cell) - zero the hidden and cell states
+// void name##_step(name *cell, const double *x) - one timestep with input x[I] (like forward_pass_n_lstm with n = 1), the results are in cell->h[H], cell->c[H] and cell->y[O]
+//
+// the weights are stored transposed (wt = wp^T, wyt = wy^T), so the weights of every gate unit for one input are contiguous: the gate products add wt[k] * xh[k]
+// to all the gates for every k, a loop over a constant length with no dependency between iterations the compiler vectorizes without reordering the sums
+// (same results as the generic lstm). build the code using it with -O3 -march=native: with plain -O2 the loops stay mostly scalar and the cell is no faster
+// than the generic lstm with its small matrix kernels.
+// the activations use the vmath kernels over the whole gate block. the struct is about 8 * (4H(I + H + 1) + O(H + 1)) bytes, it fits on the stack only for small sizes.
+//
+// example:
+// LSTM_FIXED_DEFINE(cell_8x32x8, 8, 32, 8)
+// cell_8x32x8 cell;
+// cell_8x32x8_import(&cell, lstm);
+// cell_8x32x8_step(&cell, x);
+
+#define LSTM_FIXED_DEFINE(name, I, H, O) \
+typedef struct { \
+	double wt[(I) + (H)][4 * (H)]; /* wp^T, row k = weights of xh[k] for every gate unit */ \
+	double bp[4 * (H)]; \
+	double wyt[H][O]; /* wy^T */ \
+	double by[O]; \
+	double xh[(I) + (H)]; /* [x; hp] */ \
+	double g[4 * (H)]; /* [f; i; o; ca] */ \
+	double cp[H]; \
+	double c[H]; \
+	double h[H]; \
+	double y[O]; \
+} name; \
+\
+static inline int name##_import(name *cell, LSTM *lstm) { \
+	if (lstm->input_dim != (I) || lstm->hidden_dim != (H) || lstm->output_dim != (O)) { \
+		printf("ERROR: LSTM DIMENSIONS DON'T MATCH THE FIXED CELL " #name "!\n"); \
+		return -1; \
+	} \
+	for (int r = 0; r < 4 * (H); r++) { \
+		for (int k = 0; k < (I) + (H); k++) cell->wt[k][r] = gsl_matrix_get(lstm->wp, r, k); \
+		cell->bp[r] = gsl_vector_get(lstm->bp, r); \
+	} \
+	for (int r = 0; r < (O); r++) { \
+		for (int k = 0; k < (H); k++) cell->wyt[k][r] = gsl_matrix_get(lstm->wy, r, k); \
+		cell->by[r] = gsl_vector_get(lstm->by, r); \
+	} \
+	memset(cell->xh, 0, sizeof(cell->xh)); \
+	for (int k = 0; k < (H); k++) { \
+		cell->xh[(I) + k] = gsl_vector_get(lstm->hp, k); \
+		cell->cp[k] = gsl_vector_get(lstm->cp, k); \
+	} \
+	return 0; \
+} \
+\
+static inline void name##_reset(name *cell) { \
+	memset(cell->xh + (I), 0, (H) * sizeof(double)); \
+	memset(cell->cp, 0, sizeof(cell->cp)); \
+} \
+\
+static inline void name##_step(name *cell, const double *x) { \
+	memcpy(cell->xh, x, (I) * sizeof(double)); \
+\
+	/* gates: g = bp + wp * xh as a sum of the columns of wp scaled by xh[k], the inner loop runs over contiguous weights */ \
+	memcpy(cell->g, cell->bp, sizeof(cell->g)); \
+	for (int k = 0; k < (I) + (H); k++) { \
+		double xk = cell->xh[k]; \
+		for (int r = 0; r < 4 * (H); r++) cell->g[r] += cell->wt[k][r] * xk; \
+	} \
+	sigmoid_array(cell->g, cell->g, 3 * (H)); \
+	tanh_array(cell->g + 3 * (H), cell->g + 3 * (H), H); \
+\
+	/* c = f * cp + i * ca, h = o * tanh(c) */ \
+	for (int k = 0; k < (H); k++) cell->c[k] = cell->g[k] * cell->cp[k] + cell->g[(H) + k] * cell->g[3 * (H) + k]; \
+	tanh_array(cell->c, cell->h, H); \
+	for (int k = 0; k < (H); k++) cell->h[k] *= cell->g[2 * (H) + k]; \
+\
+	/* y = by + wy * h */ \
+	memcpy(cell->y, cell->by, sizeof(cell->y)); \
+	for (int k = 0; k < (H); k++) { \
+		double hk = cell->h[k]; \
+		for (int r = 0; r < (O); r++) cell->y[r] += cell->wyt[k][r] * hk; \
+	} \
+\
+	/* the outputs become the previous state */ \
+	memcpy(cell->xh + (I), cell->h, (H) * sizeof(double)); \
+	memcpy(cell->cp, cell->c, sizeof(cell->cp)); \
+}
+
+#endif
@@ -0,0 +1,116 @@
+// generic source of the fused forward pass, shared by the double precision engine (LSTM in lstm.c) and the single precision engine (LSTMF in lstmf.c).
+// it's included once per precision, after defining:
+// REAL - element type (double or float)
+// VEC, MAT - the gsl vector and matrix types of REAL (i.e gsl_vector_float, gsl_matrix_float)
+// TMPL(name) - the name of a function for this precision
+// CBLAS(name) - the cblas function for REAL, i.e CBLAS(gemv) = cblas_sgemv for floats
+// SIGMOID_ARRAY, TANH_ARRAY - the activation kernels for REAL from vmath.h
+// all the macros are undefined at the end of this file. there's no include guard on purpose.
+//
+// the functions expect the packed layout described in lstm.h, and all vectors to be contiguous (stride 1).
+// instrument.h has to be included too, fused_step counts its phases like the per gate functions.
+// the functions are static inline, so a file can use only some of them (sparse.c and lstmq.c compute the gate products their own way) without unused function warnings.
+
+// y = b + a * x for a small row major matrix a (rows x cols, lda = row stride), y may be the same array as b.
+// 4 rows at a time: every x[k] is loaded once for 4 rows and the 4 sums stay in registers. for tiny matrices this beats blas, whose call and checks cost more than the arithmetic
+static inline void TMPL(small_matvec)(int rows, int cols, const REAL *a, int lda, const REAL *x, const REAL *b, REAL *y) {
+	int r = 0;
+
+	for (; r + 4 <= rows; r += 4) {
+		const REAL *a0 = a + r * lda;
+		const REAL *a1 = a0 + lda;
+		const REAL *a2 = a1 + lda;
+		const REAL *a3 = a2 + lda;
+		REAL s0 = b[r], s1 = b[r + 1], s2 = b[r + 2], s3 = b[r + 3];
+
+		for (int k = 0; k < cols; k++) {
+			REAL xk = x[k];
+			s0 += a0[k] * xk;
+			s1 += a1[k] * xk;
+			s2 += a2[k] * xk;
+			s3 += a3[k] * xk;
+		}
+
+		y[r] = s0;
+		y[r + 1] = s1;
+		y[r + 2] = s2;
+		y[r + 3] = s3;
+	}
+
+	for (; r < rows; r++) {
+		const REAL *ar = a + r * lda;
+		REAL s = b[r];
+		for (int k = 0; k < cols; k++) s += ar[k] * x[k];
+		y[r] = s;
+	}
+}
+
+// y = b + a * x, with small_matvec up to lstm_small_kernel elements of a and blas above
+static inline void TMPL(matvec_bias)(const MAT *a, const REAL *x, const REAL *b, REAL *y) {
+	if (a->size1 * a->size2 <= (size_t)lstm_small_kernel) {
+		TMPL(small_matvec)(a->size1, a->size2, a->data, a->tda, x, b, y);
+		return;
+	}
+
+	if (y != b) memcpy(y, b, a->size1 * sizeof(REAL));
+	CBLAS(gemv)(CblasRowMajor, CblasNoTrans, a->size1, a->size2, 1, a->data, a->tda, x, 1, 1, y, 1);
+}
+
+// g = wp * xh + bp
+static inline void TMPL(project_gates)(const MAT *wp, const VEC *bp, const VEC *xh, VEC *g) {
+	TMPL(matvec_bias)(wp, xh->data, bp->data, g->data);
+}
+
+// applies the gate activations in place: g = [sigmoid; sigmoid; sigmoid; tanh](g)
+static inline void TMPL(activate_gates)(VEC *g, int hidden_dim) {
+	SIGMOID_ARRAY(g->data, g->data, 3 * hidden_dim);
+	TANH_ARRAY(g->data + 3 * hidden_dim, g->data + 3 * hidden_dim, hidden_dim);
+}
+
+// c = f * cp + i * ca, h = o * tanh(c)
+static inline void TMPL(state_eqs)(const VEC *g, const VEC *cp, VEC *c, VEC *h) {
+	int hidden_dim = c->size;
+	const REAL *f = g->data;
+	const REAL *i = g->data + hidden_dim;
+	const REAL *o = g->data + 2 * hidden_dim;
+	const REAL *ca = g->data + 3 * hidden_dim;
+
+	for (int k = 0; k < hidden_dim; k++) {
+		c->data[k] = f[k] * cp->data[k] + i[k] * ca[k];
+	}
+
+	TANH_ARRAY(c->data, h->data, hidden_dim);
+	for (int k = 0; k < hidden_dim; k++) {
+		h->data[k] *= o[k];
+	}
+}
+
+// y = wy * h + by
+static inline void TMPL(output)(const MAT *wy, const VEC *by, const VEC *h, VEC *y) {
+	TMPL(matvec_bias)(wy, h->data, by->data, y->data);
+}
+
+// one whole timestep, the inputs are xh = [x; hp] and cp
+static inline void TMPL(fused_step)(const MAT *wp, const VEC *bp, const MAT *wy, const VEC *by, const VEC *xh, VEC *g, const VEC *cp, VEC *c, VEC *h, VEC *y) {
+	INSTR_BEGIN(INSTR_GATE);
+	TMPL(project_gates)(wp, bp, xh, g);
+	TMPL(activate_gates)(g, c->size);
+	INSTR_END(INSTR_GATE, 2 * wp->size1 * wp->size2, 0);
+
+	// the cell and hidden states are computed in one loop each, state_eqs is counted as cstate
+	INSTR_BEGIN(INSTR_CSTATE);
+	TMPL(state_eqs)(g, cp, c, h);
+	INSTR_END(INSTR_CSTATE, 4 * c->size, 0);
+
+	INSTR_BEGIN(INSTR_OUTPUT);
+	TMPL(output)(wy, by, h, y);
+	INSTR_END(INSTR_OUTPUT, 2 * wy->size1 * wy->size2 + y->size, 0);
+}
+
+#undef REAL
+#undef VEC
+#undef MAT
+#undef TMPL
+#undef CBLAS
+#undef SIGMOID_ARRAY
+#undef TANH_ARRAY
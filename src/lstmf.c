@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_cblas.h>
+#include "vmath.h"
+#include "instrument.h"
+#include "lstm.h"
+#include "lstmf.h"
+
+// single precision instance of the fused forward pass (fused_step_f, ...)
+#define REAL float
+#define VEC gsl_vector_float
+#define MAT gsl_matrix_float
+#define TMPL(name) name##_f
+#define CBLAS(name) cblas_s##name
+#define SIGMOID_ARRAY sigmoidf_array
+#define TANH_ARRAY tanhf_array
+#include "lstm_tmpl.h"
+
+// float version of create_subvector_view (see nutils.h)
+static gsl_vector_float *create_subvector_view_float(gsl_vector_float *v, int offset, int n) {
+	gsl_vector_float *r = (gsl_vector_float *)malloc(sizeof(gsl_vector_float));
+	if (r == NULL) printf("ERROR: FAILED TO ALLOCATE VECTOR VIEW!\n");
+
+	*r = gsl_vector_float_subvector(v, offset, n).vector;
+	return r;
+}
+
+// copies a double matrix/vector into a float one of the same size
+static void matrix_to_float(gsl_matrix *m, gsl_matrix_float *r) {
+	for (int i = 0; i < (int)m->size1; i++) {
+		for (int j = 0; j < (int)m->size2; j++) {
+			gsl_matrix_float_set(r, i, j, (float)gsl_matrix_get(m, i, j));
+		}
+	}
+}
+
+static void vector_to_float(gsl_vector *v, gsl_vector_float *r) {
+	for (int i = 0; i < (int)v->size; i++) {
+		gsl_vector_float_set(r, i, (float)gsl_vector_get(v, i));
+	}
+}
+
+LSTMF *create_lstmf(int input_dim, int hidden_dim, int output_dim) {
+	LSTMF *lstmf = (LSTMF *)malloc(sizeof(LSTMF));
+	if (lstmf == NULL) printf("ERROR: FAILED TO ALLOCATE LSTMF STRUCT!\n");
+
+	// dimensions
+	lstmf->input_dim = input_dim;
+	lstmf->hidden_dim = hidden_dim;
+	lstmf->output_dim = output_dim;
+
+	// packed blocks
+	lstmf->wp = gsl_matrix_float_calloc(4 * hidden_dim, input_dim + hidden_dim);
+	lstmf->bp = gsl_vector_float_calloc(4 * hidden_dim);
+	lstmf->xh = gsl_vector_float_calloc(input_dim + hidden_dim);
+	lstmf->g = gsl_vector_float_calloc(4 * hidden_dim);
+
+	lstmf->wy = gsl_matrix_float_calloc(output_dim, hidden_dim);
+	lstmf->by = gsl_vector_float_calloc(output_dim);
+
+	// input vectors
+	lstmf->x = create_subvector_view_float(lstmf->xh, 0, input_dim);
+	lstmf->hp = create_subvector_view_float(lstmf->xh, input_dim, hidden_dim);
+	lstmf->cp = gsl_vector_float_calloc(hidden_dim);
+
+	// output vectors
+	lstmf->y = gsl_vector_float_calloc(output_dim);
+	lstmf->h = gsl_vector_float_calloc(hidden_dim);
+	lstmf->c = gsl_vector_float_calloc(hidden_dim);
+
+	return lstmf;
+}
+
+LSTMF *convert_lstmf(LSTM *lstm) {
+	LSTMF *lstmf = create_lstmf(lstm->input_dim, lstm->hidden_dim, lstm->output_dim);
+
+	// weights and biases
+	matrix_to_float(lstm->wp, lstmf->wp);
+	vector_to_float(lstm->bp, lstmf->bp);
+	matrix_to_float(lstm->wy, lstmf->wy);
+	vector_to_float(lstm->by, lstmf->by);
+
+	// states
+	vector_to_float(lstm->xh, lstmf->xh);
+	vector_to_float(lstm->g, lstmf->g);
+	vector_to_float(lstm->cp, lstmf->cp);
+	vector_to_float(lstm->y, lstmf->y);
+	vector_to_float(lstm->h, lstmf->h);
+	vector_to_float(lstm->c, lstmf->c);
+
+	return lstmf;
+}
+
+void free_lstmf(LSTMF *lstmf) {
+	// views
+	gsl_vector_float_free(lstmf->x);
+	gsl_vector_float_free(lstmf->hp);
+
+	// packed blocks
+	gsl_matrix_float_free(lstmf->wp);
+	gsl_vector_float_free(lstmf->bp);
+	gsl_vector_float_free(lstmf->xh);
+	gsl_vector_float_free(lstmf->g);
+
+	gsl_matrix_float_free(lstmf->wy);
+	gsl_vector_float_free(lstmf->by);
+
+	// states
+	gsl_vector_float_free(lstmf->cp);
+	gsl_vector_float_free(lstmf->y);
+	gsl_vector_float_free(lstmf->h);
+	gsl_vector_float_free(lstmf->c);
+
+	free(lstmf);
+}
+
+void forward_pass_lstmf(LSTMF *lstmf) {
+	fused_step_f(lstmf->wp, lstmf->bp, lstmf->wy, lstmf->by, lstmf->xh, lstmf->g, lstmf->cp, lstmf->c, lstmf->h, lstmf->y);
+}
+
+void forward_pass_n_lstmf(LSTMF *lstmf, gsl_vector_float **arr, int n) {
+	for (int i = 0; i < n; i++) {
+		gsl_blas_scopy(arr[i], lstmf->x);
+		forward_pass_lstmf(lstmf);
+		gsl_blas_scopy(lstmf->h, lstmf->hp);
+		gsl_blas_scopy(lstmf->c, lstmf->cp);
+	}
+}
+
+void input_vector_lstmf(LSTMF *lstmf, gsl_vector *v) {
+	vector_to_float(v, lstmf->x);
+}
@@ -0,0 +1,45 @@
+#ifndef LSTMF_H
+#define LSTMF_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "lstm.h"
+
+// single precision (float) version of the LSTM, for inference only.
+// it stores the same packed blocks as an LSTM (see lstm.h) in gsl_vector_float/gsl_matrix_float, so the weights take half the memory and the matrix-vector products use cblas_sgemv.
+// the forward pass is generated from the same source as the double precision one (lstm_tmpl.h).
+// the usual way to get one is to train an LSTM and convert it with convert_lstmf.
+typedef struct {
+	// dimensions
+	int input_dim;
+	int output_dim;
+	int hidden_dim;
+
+	// packed blocks
+	gsl_matrix_float *wp; // [wf uf; wi ui; wo uo; wc uc]
+	gsl_vector_float *bp; // [bf; bi; bo; bc]
+	gsl_vector_float *xh; // [x; hp]
+	gsl_vector_float *g; // [f; i; o; ca]
+
+	gsl_matrix_float *wy; // output weight
+	gsl_vector_float *by; // output bias
+
+	// input vectors (x and hp are views into xh)
+	gsl_vector_float *x;
+	gsl_vector_float *hp;
+	gsl_vector_float *cp;
+
+	// output vectors
+	gsl_vector_float *y;
+	gsl_vector_float *h;
+	gsl_vector_float *c;
+} LSTMF;
+
+LSTMF *create_lstmf(int input_dim, int hidden_dim, int output_dim); // create float lstm with all values initialized to 0
+LSTMF *convert_lstmf(LSTM *lstm); // create a float lstm with the weights, biases and states of lstm (rounded to float)
+void free_lstmf(LSTMF *lstmf); // delete float lstm
+void forward_pass_lstmf(LSTMF *lstmf); // does a forward pass
+void forward_pass_n_lstmf(LSTMF *lstmf, gsl_vector_float **arr, int n); // does a forward pass over a series of n float vectors, like forward_pass_n_lstm
+void input_vector_lstmf(LSTMF *lstmf, gsl_vector *v); // input a (double) vector into the float lstm
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_cblas.h>
+#include "vmath.h"
+#include "instrument.h"
+#include "lstm.h"
+#include "lstmq.h"
+
+// the cell equations of the fused forward pass, in single precision like LSTMF
+#define REAL float
+#define VEC gsl_vector_float
+#define MAT gsl_matrix_float
+#define TMPL(name) name##_f
+#define CBLAS(name) cblas_s##name
+#define SIGMOID_ARRAY sigmoidf_array
+#define TANH_ARRAY tanhf_array
+#include "lstm_tmpl.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+// a . b of n int8 values, 32 at a time. maddubs multiplies unsigned by signed bytes, so the sign of a is moved onto b first:
+// |a| * (b * sign(a)) = a * b, and the sums of pairs it makes are at most 2 * 127 * 127, which fits the int16 lanes without saturating
+static int32_t dot_i8(const int8_t *a, const int8_t *b, int n) {
+	__m256i acc = _mm256_setzero_si256();
+	__m256i ones = _mm256_set1_epi16(1);
+	int k = 0;
+
+	for (; k + 32 <= n; k += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + k));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + k));
+		__m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
+	}
+
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+	int32_t sum = _mm_cvtsi128_si32(s);
+
+	for (; k < n; k++) sum += (int32_t)a[k] * b[k];
+	return sum;
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+// a . b of n int8 values, 16 at a time: the bytes are sign extended to int16 and multiplied and summed in pairs into int32 by madd
+static int32_t dot_i8(const int8_t *a, const int8_t *b, int n) {
+	__m128i acc = _mm_setzero_si128();
+	__m128i zero = _mm_setzero_si128();
+	int k = 0;
+
+	for (; k + 16 <= n; k += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + k));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + k));
+		__m128i sa = _mm_cmpgt_epi8(zero, va); // sign bytes
+		__m128i sb = _mm_cmpgt_epi8(zero, vb);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, sa), _mm_unpacklo_epi8(vb, sb)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, sa), _mm_unpackhi_epi8(vb, sb)));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	int32_t sum = _mm_cvtsi128_si32(acc);
+
+	for (; k < n; k++) sum += (int32_t)a[k] * b[k];
+	return sum;
+}
+
+#else
+
+static int32_t dot_i8(const int8_t *a, const int8_t *b, int n) {
+	int32_t sum = 0;
+	for (int k = 0; k < n; k++) sum += (int32_t)a[k] * b[k];
+	return sum;
+}
+
+#endif
+
+// q = v / scale rounded, for n doubles. returns scale = max |v| / 127 (0 when v is all zeros, then q is all zeros too)
+static float quantize_d(const double *v, int8_t *q, int n) {
+	double m = 0;
+	for (int k = 0; k < n; k++) m = fmax(m, fabs(v[k]));
+	if (m == 0) {
+		memset(q, 0, n);
+		return 0;
+	}
+
+	double inv = 127 / m;
+	for (int k = 0; k < n; k++) q[k] = (int8_t)lrint(v[k] * inv);
+	return (float)(m / 127);
+}
+
+// same for floats
+static float quantize_f(const float *v, int8_t *q, int n) {
+	float m = 0;
+	for (int k = 0; k < n; k++) m = fmaxf(m, fabsf(v[k]));
+	if (m == 0) {
+		memset(q, 0, n);
+		return 0;
+	}
+
+	float inv = 127 / m;
+	for (int k = 0; k < n; k++) q[k] = (int8_t)lrintf(v[k] * inv);
+	return m / 127;
+}
+
+static void vector_to_float(gsl_vector *v, gsl_vector_float *r) {
+	for (int i = 0; i < (int)v->size; i++) {
+		gsl_vector_float_set(r, i, (float)gsl_vector_get(v, i));
+	}
+}
+
+static void *alloc_block(size_t size) {
+	void *p = calloc(size, 1);
+	if (p == NULL) printf("ERROR: FAILED TO ALLOCATE LSTMQ BLOCK!\n");
+	return p;
+}
+
+LSTMQ *create_lstmq(int input_dim, int hidden_dim, int output_dim) {
+	LSTMQ *lstmq = (LSTMQ *)malloc(sizeof(LSTMQ));
+	if (lstmq == NULL) printf("ERROR: FAILED TO ALLOCATE LSTMQ STRUCT!\n");
+
+	// dimensions
+	lstmq->input_dim = input_dim;
+	lstmq->hidden_dim = hidden_dim;
+	lstmq->output_dim = output_dim;
+
+	// quantized weights
+	lstmq->wp = (int8_t *)alloc_block((size_t)4 * hidden_dim * (input_dim + hidden_dim));
+	lstmq->ws = (float *)alloc_block(4 * hidden_dim * sizeof(float));
+	lstmq->us = (float *)alloc_block(4 * hidden_dim * sizeof(float));
+	lstmq->wy = (int8_t *)alloc_block((size_t)output_dim * hidden_dim);
+	lstmq->wys = (float *)alloc_block(output_dim * sizeof(float));
+
+	// biases
+	lstmq->bp = gsl_vector_float_calloc(4 * hidden_dim);
+	lstmq->by = gsl_vector_float_calloc(output_dim);
+
+	// quantized inputs
+	lstmq->xhq = (int8_t *)alloc_block(input_dim + hidden_dim);
+	lstmq->hq = (int8_t *)alloc_block(hidden_dim);
+
+	// float vectors
+	lstmq->g = gsl_vector_float_calloc(4 * hidden_dim);
+	lstmq->x = gsl_vector_float_calloc(input_dim);
+	lstmq->hp = gsl_vector_float_calloc(hidden_dim);
+	lstmq->cp = gsl_vector_float_calloc(hidden_dim);
+	lstmq->y = gsl_vector_float_calloc(output_dim);
+	lstmq->h = gsl_vector_float_calloc(hidden_dim);
+	lstmq->c = gsl_vector_float_calloc(hidden_dim);
+
+	return lstmq;
+}
+
+LSTMQ *convert_lstmq(LSTM *lstm) {
+	int I = lstm->input_dim, H = lstm->hidden_dim, O = lstm->output_dim;
+	LSTMQ *lstmq = create_lstmq(I, H, O);
+
+	// weights, the w and u part of every row of wp separately
+	for (int r = 0; r < 4 * H; r++) {
+		const double *row = lstm->wp->data + (size_t)r * lstm->wp->tda;
+		int8_t *q = lstmq->wp + (size_t)r * (I + H);
+		lstmq->ws[r] = quantize_d(row, q, I);
+		lstmq->us[r] = quantize_d(row + I, q + I, H);
+	}
+	for (int r = 0; r < O; r++) {
+		lstmq->wys[r] = quantize_d(lstm->wy->data + (size_t)r * lstm->wy->tda, lstmq->wy + (size_t)r * H, H);
+	}
+
+	// biases
+	vector_to_float(lstm->bp, lstmq->bp);
+	vector_to_float(lstm->by, lstmq->by);
+
+	// states
+	vector_to_float(lstm->x, lstmq->x);
+	vector_to_float(lstm->hp, lstmq->hp);
+	vector_to_float(lstm->cp, lstmq->cp);
+	vector_to_float(lstm->g, lstmq->g);
+	vector_to_float(lstm->y, lstmq->y);
+	vector_to_float(lstm->h, lstmq->h);
+	vector_to_float(lstm->c, lstmq->c);
+
+	return lstmq;
+}
+
+void free_lstmq(LSTMQ *lstmq) {
+	// quantized weights and inputs
+	free(lstmq->wp);
+	free(lstmq->ws);
+	free(lstmq->us);
+	free(lstmq->wy);
+	free(lstmq->wys);
+	free(lstmq->xhq);
+	free(lstmq->hq);
+
+	// biases
+	gsl_vector_float_free(lstmq->bp);
+	gsl_vector_float_free(lstmq->by);
+
+	// float vectors
+	gsl_vector_float_free(lstmq->g);
+	gsl_vector_float_free(lstmq->x);
+	gsl_vector_float_free(lstmq->hp);
+	gsl_vector_float_free(lstmq->cp);
+	gsl_vector_float_free(lstmq->y);
+	gsl_vector_float_free(lstmq->h);
+	gsl_vector_float_free(lstmq->c);
+
+	free(lstmq);
+}
+
+void forward_pass_lstmq(LSTMQ *lstmq) {
+	int I = lstmq->input_dim, H = lstmq->hidden_dim, O = lstmq->output_dim;
+	float *g = lstmq->g->data, *bp = lstmq->bp->data;
+	float *h = lstmq->h->data, *y = lstmq->y->data, *by = lstmq->by->data;
+
+	// gates: g = bp + dequantized (wp * xh), then the activations
+	INSTR_BEGIN(INSTR_GATE);
+	float xs = quantize_f(lstmq->x->data, lstmq->xhq, I);
+	float hs = quantize_f(lstmq->hp->data, lstmq->xhq + I, H);
+	for (int r = 0; r < 4 * H; r++) {
+		const int8_t *row = lstmq->wp + (size_t)r * (I + H);
+		g[r] = bp[r] + lstmq->ws[r] * xs * (float)dot_i8(row, lstmq->xhq, I) + lstmq->us[r] * hs * (float)dot_i8(row + I, lstmq->xhq + I, H);
+	}
+	activate_gates_f(lstmq->g, H);
+	INSTR_END(INSTR_GATE, 8.0 * H * (I + H), 0);
+
+	// the state equations of the fused forward pass, the output layer is quantized again
+	INSTR_BEGIN(INSTR_CSTATE);
+	state_eqs_f(lstmq->g, lstmq->cp, lstmq->c, lstmq->h);
+	INSTR_END(INSTR_CSTATE, 4.0 * H, 0);
+
+	// y = by + dequantized (wy * h)
+	INSTR_BEGIN(INSTR_OUTPUT);
+	float ys = quantize_f(h, lstmq->hq, H);
+	for (int r = 0; r < O; r++) y[r] = by[r] + lstmq->wys[r] * ys * (float)dot_i8(lstmq->wy + (size_t)r * H, lstmq->hq, H);
+	INSTR_END(INSTR_OUTPUT, 2.0 * O * H, 0);
+}
+
+void forward_pass_n_lstmq(LSTMQ *lstmq, gsl_vector **arr, int n) {
+	for (int i = 0; i < n; i++) {
+		input_vector_lstmq(lstmq, arr[i]);
+		forward_pass_lstmq(lstmq);
+		gsl_blas_scopy(lstmq->h, lstmq->hp);
+		gsl_blas_scopy(lstmq->c, lstmq->cp);
+	}
+}
+
+void input_vector_lstmq(LSTMQ *lstmq, gsl_vector *v) {
+	vector_to_float(v, lstmq->x);
+}
+
+long weight_bytes_lstmq(LSTMQ *lstmq) {
+	long I = lstmq->input_dim, H = lstmq->hidden_dim, O = lstmq->output_dim;
+	long weights = 4 * H * (I + H) + O * H; // int8
+	long floats = 2 * 4 * H + O + 4 * H + O; // scales and biases
+
+	return weights + floats * (long)sizeof(float);
+}
+
+void error_lstmq(LSTM *lstm, LSTMQ *lstmq, gsl_vector **series, int n, LSTMQ_ERROR *err) {
+	int O = lstm->output_dim;
+	int predict = lstm->output_dim == lstm->input_dim;
+	double sum = 0;
+
+	memset(err, 0, sizeof(LSTMQ_ERROR));
+	gsl_vector_set_zero(lstm->hp);
+	gsl_vector_set_zero(lstm->cp);
+	gsl_vector_float_set_zero(lstmq->hp);
+	gsl_vector_float_set_zero(lstmq->cp);
+
+	for (int t = 0; t < n; t++) {
+		forward_pass_n_lstm(lstm, &series[t], 1);
+		forward_pass_n_lstmq(lstmq, &series[t], 1);
+
+		for (int k = 0; k < O; k++) {
+			double y = gsl_vector_get(lstm->y, k);
+			double yq = gsl_vector_float_get(lstmq->y, k);
+			err->max_err = fmax(err->max_err, fabs(y - yq));
+			sum += (y - yq) * (y - yq);
+
+			// loss like series_loss in backprop.c: the output of timestep t predicts the input of timestep t + 1
+			if (predict && t < n - 1) {
+				double target = gsl_vector_get(series[t + 1], k);
+				err->loss += (y - target) * (y - target);
+				err->loss_q += (yq - target) * (yq - target);
+			}
+		}
+	}
+
+	if (n > 0 && O > 0) err->rms_err = sqrt(sum / ((double)n * O));
+}
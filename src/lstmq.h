@@ -0,0 +1,67 @@
+#ifndef LSTMQ_H
+#define LSTMQ_H
+
+#include <stdint.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "lstm.h"
+
+// int8 quantized version of the LSTM, for inference only (post-training quantization of a trained LSTM with convert_lstmq).
+//
+// weights: every row of wf, wi, wo, wc, uf, ui, uo, uc and wy is stored as int8 in [-127, 127] with its own float scale, w = scale * q, scale = max |w| of the row / 127.
+// wp keeps the packed layout of lstm.h ([wf uf; wi ui; wo uo; wc uc]), the w and u parts of a row have separate scales (ws and us) since they multiply inputs of different ranges.
+// activations: x, hp and h are quantized the same way at every timestep, with one scale per vector.
+// the gate products are int8 x int8 dot products summed in int32 (vectorized with AVX2 or SSE2, see vm_isa() in vmath.h), dequantized with the two scales and added to the float bias:
+// g[r] = bp[r] + ws[r] * xs * (wq[r] . xq) + us[r] * hs * (uq[r] . hq)
+// everything after the gate products (activations, state equations) runs in float like LSTMF, the cell state is never quantized.
+// the weights take about 1/8 of the memory of the LSTM. the int32 sums can't overflow for input_dim and hidden_dim below 2^31 / 127^2 (133000).
+typedef struct {
+	// dimensions
+	int input_dim;
+	int output_dim;
+	int hidden_dim;
+
+	// quantized weights, row by row
+	int8_t *wp; // [wf uf; wi ui; wo uo; wc uc], (4 * hidden_dim) x (input_dim + hidden_dim)
+	float *ws; // scale of the w part (first input_dim columns) of each row of wp
+	float *us; // scale of the u part (last hidden_dim columns) of each row of wp
+	int8_t *wy; // output weight, output_dim x hidden_dim
+	float *wys; // scale of each row of wy
+
+	// biases (float)
+	gsl_vector_float *bp; // [bf; bi; bo; bc]
+	gsl_vector_float *by;
+
+	// quantized inputs of the current timestep
+	int8_t *xhq; // [x; hp]
+	int8_t *hq; // h, for the output layer
+
+	// float vectors
+	gsl_vector_float *g; // [f; i; o; ca]
+	gsl_vector_float *x;
+	gsl_vector_float *hp;
+	gsl_vector_float *cp;
+	gsl_vector_float *y;
+	gsl_vector_float *h;
+	gsl_vector_float *c;
+} LSTMQ;
+
+// accuracy of a quantized lstm against the lstm it was converted from, see error_lstmq
+typedef struct {
+	double max_err; // largest |y - yq| over every output and timestep
+	double rms_err; // root mean square of y - yq
+	double loss; // loss of the lstm predicting the next element of the series (like bp_series_lstm), 0 if output_dim != input_dim
+	double loss_q; // same for the quantized lstm
+} LSTMQ_ERROR;
+
+LSTMQ *create_lstmq(int input_dim, int hidden_dim, int output_dim); // create quantized lstm with all values initialized to 0
+LSTMQ *convert_lstmq(LSTM *lstm); // quantize the weights of lstm, copy its biases and states (rounded to float)
+void free_lstmq(LSTMQ *lstmq); // delete quantized lstm
+void forward_pass_lstmq(LSTMQ *lstmq); // does a forward pass, uses x, hp and cp as inputs
+void forward_pass_n_lstmq(LSTMQ *lstmq, gsl_vector **arr, int n); // does a forward pass over a series of n (double) vectors, like forward_pass_n_lstm
+void input_vector_lstmq(LSTMQ *lstmq, gsl_vector *v); // input a (double) vector into the quantized lstm
+long weight_bytes_lstmq(LSTMQ *lstmq); // memory taken by the weights, scales and biases
+void error_lstmq(LSTM *lstm, LSTMQ *lstmq, gsl_vector **series, int n, LSTMQ_ERROR *err); // run both lstms over series from zero states and compare their outputs.
+// meant for a held-out series the lstm wasn't trained on. the states of both lstms are overwritten
+
+#endif
@@ -7,6 +7,7 @@
 #include <time.h>
 #include <math.h>
 #include "nutils.h"
+#include "vmath.h"
 
 void init_utils() {
 	// initializes the randomizer
@@ -14,11 +15,16 @@ void init_utils() {
 }
 
 double sigmoid(double n) {
-    return (1 / (1 + pow(EULER_NUMBER, -n)));
+    return (1 / (1 + exp(-n)));
 }
 
 void tanh_vector(gsl_vector *v, gsl_vector *r) {
 	int size = v->size;
+
+	if (v->stride == 1 && r->stride == 1) {
+		tanh_array(v->data, r->data, size);
+		return;
+	}
 	
 	for (int i = 0; i < size; i++) {
 		gsl_vector_set(r, i, tanh(gsl_vector_get(v, i)));
@@ -27,6 +33,11 @@ void tanh_vector(gsl_vector *v, gsl_vector *r) {
 
 void sech_vector(gsl_vector *v, gsl_vector *r) {
 	int size = v->size;
+
+	if (v->stride == 1 && r->stride == 1) {
+		sech_array(v->data, r->data, size);
+		return;
+	}
 	
 	for (int i = 0; i < size; i++) {
 		gsl_vector_set(r, i, 1/cosh(gsl_vector_get(v, i)));
@@ -47,6 +58,12 @@ void concatenate_vector(gsl_vector *a, gsl_vector *b, gsl_vector *r) {
 
 void sigmoid_vector(gsl_vector *v, gsl_vector *r) {
 	int size = v->size;
+
+	if (v->stride == 1 && r->stride == 1) {
+		sigmoid_array(v->data, r->data, size);
+		return;
+	}
+
 	for (int i = 0; i < size; i++) {
 		gsl_vector_set(r, i, sigmoid(gsl_vector_get(v, i)));
 	}
@@ -55,11 +72,55 @@ void sigmoid_vector(gsl_vector *v, gsl_vector *r) {
 void hdm_vector(gsl_vector *a, gsl_vector *b, gsl_vector *r) {
 	int size = a->size;
 
+	if (a->stride == 1 && b->stride == 1 && r->stride == 1) {
+		// plain loop over contiguous memory, the compiler can vectorize this
+		double *ad = a->data;
+		double *bd = b->data;
+		double *rd = r->data;
+
+		for (int i = 0; i < size; i++) {
+			rd[i] = ad[i] * bd[i];
+		}
+		return;
+	}
+
 	for (int i = 0; i < size; i++) {
 		gsl_vector_set(r, i, gsl_vector_get(a, i) * gsl_vector_get(b, i));
 	}
 }
 		
+gsl_matrix *create_submatrix_view(gsl_matrix *m, int k1, int k2, int n1, int n2) {
+	gsl_matrix *r = (gsl_matrix *)malloc(sizeof(gsl_matrix));
+	if (r == NULL) printf("ERROR: FAILED TO ALLOCATE MATRIX VIEW!\n");
+
+	*r = gsl_matrix_submatrix(m, k1, k2, n1, n2).matrix; // owner = 0, so the block is never freed through r
+	return r;
+}
+
+gsl_vector *create_subvector_view(gsl_vector *v, int offset, int n) {
+	gsl_vector *r = (gsl_vector *)malloc(sizeof(gsl_vector));
+	if (r == NULL) printf("ERROR: FAILED TO ALLOCATE VECTOR VIEW!\n");
+
+	*r = gsl_vector_subvector(v, offset, n).vector; // owner = 0, so the block is never freed through r
+	return r;
+}
+
+gsl_matrix *create_array_matrix_view(double *a, int n1, int n2) {
+	gsl_matrix *r = (gsl_matrix *)malloc(sizeof(gsl_matrix));
+	if (r == NULL) printf("ERROR: FAILED TO ALLOCATE MATRIX VIEW!\n");
+
+	*r = gsl_matrix_view_array(a, n1, n2).matrix; // owner = 0, the array is never freed through r
+	return r;
+}
+
+gsl_vector *create_array_vector_view(double *a, int n) {
+	gsl_vector *r = (gsl_vector *)malloc(sizeof(gsl_vector));
+	if (r == NULL) printf("ERROR: FAILED TO ALLOCATE VECTOR VIEW!\n");
+
+	*r = gsl_vector_view_array(a, n).vector; // owner = 0, the array is never freed through r
+	return r;
+}
+
 void print_vector(gsl_vector *v, char *s) {
 	printf("%s", s);
 	for (int i = 0; i < (int)v->size; i++) {
@@ -6,7 +6,7 @@
 #include <gsl/gsl_blas.h>
 
 // definition of euler's number
-#define EULER_NUMBER 2.71828
+#define EULER_NUMBER 2.718281828459045
 
 void init_utils(); // initialize utilities
 
@@ -15,6 +15,7 @@ double sigmoid(double n); // calculate sigmoid
 void sigmoid_vector(gsl_vector *v, gsl_vector *r); // calculate sigmoid of vector (outputs to r)
 void tanh_vector(gsl_vector *v, gsl_vector *r); // calculate tanh of vector
 void sech_vector(gsl_vector *v, gsl_vector *r); // calculate sech of vector
+// NOTE: sigmoid_vector, tanh_vector and sech_vector use the vectorized kernels from vmath.h when v and r are contiguous (stride 1), which is the case for all the vectors inside an LSTM.
 void concatenate_vector(gsl_vector *a, gsl_vector *b, gsl_vector *r); // combine (concatenate) two vectors
 void hdm_vector(gsl_vector *a, gsl_vector *b, gsl_vector *r); // get hadamard product of two vectors a and b and output to r
 double mse(double a, double b); // mean squared error on 2 values
@@ -35,6 +36,14 @@ void print_series_vectors(gsl_vector **v, int n, char *s); // print series of n
 // utilities for vector-matrix conversion
 gsl_matrix *convert_vtm(CBLAS_TRANSPOSE_t trans, gsl_vector *v); // converts a vector to a matrix, trans options can be = CblasNoTrans, CblasTrans only. The function won't work for CblasConjTrans.
 
+// utilities for views
+// these allocate a matrix/vector struct which points into the memory of another matrix/vector (the data isn't copied!).
+// freeing them with gsl_matrix_free/gsl_vector_free only frees the struct, the memory stays owned by the original object.
+gsl_matrix *create_submatrix_view(gsl_matrix *m, int k1, int k2, int n1, int n2); // view of the n1 x n2 block of m starting at row k1, column k2
+gsl_vector *create_subvector_view(gsl_vector *v, int offset, int n); // view of n elements of v starting at offset
+gsl_matrix *create_array_matrix_view(double *a, int n1, int n2); // n1 x n2 matrix view of the array a (row major)
+gsl_vector *create_array_vector_view(double *a, int n); // vector view of n elements of the array a
+
 // utilities for printing, s = title string
 void print_vector(gsl_vector *v, char *s); 
 void print_matrix(gsl_matrix *m, char *s);
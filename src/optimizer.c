@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "optimizer.h"
+#include "backprop.h"
+#include "lstm.h"
+#include "instrument.h"
+
+// the update rules on one contiguous block of n parameters, p = parameters, g = gradients, m/v = state of the block
+
+static void sgd_block(double *p, const double *g, int n, double lr) {
+	for (int k = 0; k < n; k++) {
+		p[k] -= lr * g[k];
+	}
+}
+
+static void momentum_block(double *p, const double *g, double *m, int n, double lr, double beta1) {
+	for (int k = 0; k < n; k++) {
+		m[k] = beta1 * m[k] + g[k];
+		p[k] -= lr * m[k];
+	}
+}
+
+static void rmsprop_block(double *p, const double *g, double *v, int n, double lr, double beta2, double eps) {
+	for (int k = 0; k < n; k++) {
+		v[k] = beta2 * v[k] + (1 - beta2) * g[k] * g[k];
+		p[k] -= lr * g[k] / (sqrt(v[k]) + eps);
+	}
+}
+
+// c1 = 1 / (1 - beta1^t), c2 = 1 / (1 - beta2^t), the bias corrections of the moments
+static void adam_block(double *p, const double *g, double *m, double *v, int n, double lr, double beta1, double beta2, double eps, double c1, double c2) {
+	for (int k = 0; k < n; k++) {
+		m[k] = beta1 * m[k] + (1 - beta1) * g[k];
+		v[k] = beta2 * v[k] + (1 - beta2) * g[k] * g[k];
+		p[k] -= lr * (m[k] * c1) / (sqrt(v[k] * c2) + eps);
+	}
+}
+
+// number of parameters of lstm, the sizes of wp, bp, wy and by
+static int parameter_count(LSTM *lstm) {
+	return lstm->wp->size1 * lstm->wp->size2 + lstm->bp->size + lstm->wy->size1 * lstm->wy->size2 + lstm->by->size;
+}
+
+OPTIMIZER *create_optimizer(OPT_TYPE type, LSTM *lstm) {
+	OPTIMIZER *opt = (OPTIMIZER *)malloc(sizeof(OPTIMIZER));
+	if (opt == NULL) printf("ERROR: FAILED TO ALLOCATE OPTIMIZER!\n");
+
+	opt->type = type;
+	opt->learning_rate = 0.001;
+	opt->beta1 = 0.9;
+	opt->beta2 = type == OPT_ADAM ? 0.999 : 0.9;
+	opt->epsilon = 1e-8;
+	opt->t = 0;
+	opt->size = parameter_count(lstm);
+	opt->m = NULL;
+	opt->v = NULL;
+
+	if (type == OPT_MOMENTUM || type == OPT_ADAM) {
+		opt->m = (double *)calloc(opt->size, sizeof(double));
+		if (opt->m == NULL) printf("ERROR: FAILED TO ALLOCATE OPTIMIZER STATE!\n");
+	}
+	if (type == OPT_RMSPROP || type == OPT_ADAM) {
+		opt->v = (double *)calloc(opt->size, sizeof(double));
+		if (opt->v == NULL) printf("ERROR: FAILED TO ALLOCATE OPTIMIZER STATE!\n");
+	}
+
+	return opt;
+}
+
+void free_optimizer(OPTIMIZER *opt) {
+	free(opt->m);
+	free(opt->v);
+	free(opt);
+}
+
+void reset_optimizer(OPTIMIZER *opt) {
+	opt->t = 0;
+	if (opt->m != NULL) memset(opt->m, 0, opt->size * sizeof(double));
+	if (opt->v != NULL) memset(opt->v, 0, opt->size * sizeof(double));
+}
+
+void step_optimizer(OPTIMIZER *opt, LSTM *lstm, BCKPROP_CXT *cxt) {
+	// the 4 parameter blocks and their gradients, in the order of the optimizer state
+	double *p[4] = {lstm->wp->data, lstm->bp->data, lstm->wy->data, lstm->by->data};
+	const double *g[4] = {cxt->dEdWp->data, cxt->dEdbp->data, cxt->dEdWy->data, cxt->dEdby->data};
+	int n[4] = {lstm->wp->size1 * lstm->wp->size2, lstm->bp->size, lstm->wy->size1 * lstm->wy->size2, lstm->by->size};
+
+	INSTR_BEGIN(INSTR_UPDATE);
+	opt->t++;
+	double c1 = 1 / (1 - pow(opt->beta1, opt->t));
+	double c2 = 1 / (1 - pow(opt->beta2, opt->t));
+
+	int offset = 0;
+	for (int b = 0; b < 4; b++) {
+		switch (opt->type) {
+			case OPT_SGD:
+				sgd_block(p[b], g[b], n[b], opt->learning_rate);
+				break;
+			case OPT_MOMENTUM:
+				momentum_block(p[b], g[b], opt->m + offset, n[b], opt->learning_rate, opt->beta1);
+				break;
+			case OPT_RMSPROP:
+				rmsprop_block(p[b], g[b], opt->v + offset, n[b], opt->learning_rate, opt->beta2, opt->epsilon);
+				break;
+			case OPT_ADAM:
+				adam_block(p[b], g[b], opt->m + offset, opt->v + offset, n[b], opt->learning_rate, opt->beta1, opt->beta2, opt->epsilon, c1, c2);
+				break;
+		}
+		offset += n[b];
+	}
+
+	// multiply-adds per parameter: 1 for sgd, 2 for momentum, about 4 for rmsprop and 6 for adam.
+	// counted from the blocks, opt->size is 0 for an optimizer without state (i.e the sgd of bp_learn_cxt)
+	INSTR_END(INSTR_UPDATE, (opt->type == OPT_SGD ? 2.0 : opt->type == OPT_MOMENTUM ? 4.0 : opt->type == OPT_RMSPROP ? 8.0 : 12.0) * (n[0] + n[1] + n[2] + n[3]), 0);
+}
@@ -0,0 +1,40 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "lstm.h"
+#include "backprop.h"
+
+// optimizers: turn the gradients of a BCKPROP_CXT into an update of the parameters of an lstm.
+// the packed layout makes every parameter of the lstm part of one of 4 contiguous blocks (wp, bp, wy, by), and the gradients of the context have the same layout,
+// so a step is 4 plain loops over contiguous memory (which the compiler vectorizes), one per block, covering all 12 gate parameters and wy/by in the same pass.
+// the state of an optimizer (velocity, moments) is stored in the same order, one double per parameter and per moment.
+//
+// formulas (p = parameter, g = gradient, t = step number starting at 1):
+// sgd: p = p - lr * g
+// momentum: m = beta1 * m + g, p = p - lr * m
+// rmsprop: v = beta2 * v + (1 - beta2) * g^2, p = p - lr * g / (sqrt(v) + epsilon)
+// adam: m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2, p = p - lr * (m / (1 - beta1^t)) / (sqrt(v / (1 - beta2^t)) + epsilon)
+
+typedef enum {OPT_SGD, OPT_MOMENTUM, OPT_RMSPROP, OPT_ADAM} OPT_TYPE;
+
+typedef struct OPTIMIZER {
+	OPT_TYPE type;
+
+	// hyperparameters, create_optimizer sets the usual defaults and they can be changed at any time
+	double learning_rate; // default 0.001
+	double beta1; // momentum / decay of the first moment, default 0.9
+	double beta2; // decay of the second moment, default 0.9 for rmsprop and 0.999 for adam
+	double epsilon; // default 1e-8
+
+	long t; // number of steps taken
+	int size; // number of parameters
+	double *m; // first moment (velocity for momentum), NULL when unused
+	double *v; // second moment, NULL when unused
+} OPTIMIZER;
+
+OPTIMIZER *create_optimizer(OPT_TYPE type, LSTM *lstm); // optimizer for the parameters of lstm, with zeroed state
+void free_optimizer(OPTIMIZER *opt);
+void reset_optimizer(OPTIMIZER *opt); // zero the state, like a freshly created optimizer
+void step_optimizer(OPTIMIZER *opt, LSTM *lstm, BCKPROP_CXT *cxt); // update every parameter of lstm with the gradients of cxt
+
+#endif
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "scheduler.h"
+#include "lstm.h"
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct timespec to_timespec(double t) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	return ts;
+}
+
+// index of the batch buffer for n steps, the smallest k with 2^k >= n
+static int bucket(int n) {
+	int k = 0;
+	while ((1 << k) < n) k++;
+	return k;
+}
+
+// move up to max_batch steps from the queue to sched->current, oldest first, skipping streams already in this batch. called with the lock held
+static int take_batch(SCHEDULER *sched) {
+	long number = ++sched->batch_number;
+	SCHED_REQUEST **link = &sched->head;
+	SCHED_REQUEST *prev = NULL;
+	int n = 0;
+
+	while (*link != NULL && n < sched->max_batch) {
+		SCHED_REQUEST *req = *link;
+		if (sched->last_batch[req->stream] == number) {
+			// a later step of a stream that is already in the batch, it has to wait for the next one
+			prev = req;
+			link = &req->next;
+			continue;
+		}
+
+		sched->last_batch[req->stream] = number;
+		sched->current[n++] = req;
+		*link = req->next;
+		if (sched->tail == req) sched->tail = prev;
+		sched->queued--;
+	}
+
+	return n;
+}
+
+// one timestep for the n steps of sched->current, without the lock (no other thread touches the states of these streams until they are done)
+static void run_batch(SCHEDULER *sched, int n) {
+	int k = bucket(n);
+	if (sched->batches[k] == NULL) sched->batches[k] = create_batch_lstm(sched->lstm, 1 << k);
+	LSTM_BATCH *batch = sched->batches[k];
+
+	// gather, the padding columns keep the values of an earlier batch and their results are ignored
+	for (int b = 0; b < n; b++) {
+		SCHED_REQUEST *req = sched->current[b];
+		LSTM_STATE *state = sched->states[req->stream];
+		gsl_matrix_set_col(batch->x, b, req->x);
+		gsl_matrix_set_col(batch->hp, b, &state->hp);
+		gsl_matrix_set_col(batch->cp, b, &state->cp);
+	}
+
+	forward_pass_step_batch_lstm(sched->lstm, batch);
+
+	// scatter, h and c become hp and cp of the stream (like step_state_lstm)
+	for (int b = 0; b < n; b++) {
+		SCHED_REQUEST *req = sched->current[b];
+		LSTM_STATE *state = sched->states[req->stream];
+		gsl_matrix_get_col(&state->hp, batch->h, b);
+		gsl_matrix_get_col(&state->cp, batch->c, b);
+		gsl_matrix_get_col(&state->y, batch->y, b);
+		if (req->y != NULL) gsl_vector_memcpy(req->y, &state->y);
+	}
+}
+
+static void *scheduler_main(void *arg) {
+	SCHEDULER *sched = (SCHEDULER *)arg;
+
+	pthread_mutex_lock(&sched->lock);
+	for (;;) {
+		while (sched->head == NULL && !sched->quit) pthread_cond_wait(&sched->work, &sched->lock);
+
+		// wait for a full batch, at most until the deadline of the oldest step
+		while (!sched->quit && sched->queued < sched->max_batch) {
+			double due = sched->head->submitted + sched->deadline;
+			if (now_sec() >= due) break;
+			struct timespec ts = to_timespec(due);
+			pthread_cond_timedwait(&sched->work, &sched->lock, &ts);
+		}
+		if (sched->quit) break;
+
+		int n = take_batch(sched);
+		pthread_mutex_unlock(&sched->lock);
+
+		run_batch(sched, n);
+
+		pthread_mutex_lock(&sched->lock);
+		double done = now_sec();
+		for (int b = 0; b < n; b++) {
+			SCHED_REQUEST *req = sched->current[b];
+			sched->latency[sched->latency_count++ % SCHED_LATENCY_WINDOW] = done - req->submitted;
+			req->done = 1;
+		}
+		sched->requests += n;
+		sched->batch_count++;
+		pthread_cond_broadcast(&sched->complete);
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+SCHEDULER *create_scheduler(LSTM *lstm, int streams, int max_batch, double deadline) {
+	if (streams <= 0 || max_batch <= 0) {
+		printf("ERROR: A SCHEDULER NEEDS AT LEAST ONE STREAM AND A MAX BATCH OF AT LEAST 1!\n");
+		return NULL;
+	}
+
+	SCHEDULER *sched = (SCHEDULER *)malloc(sizeof(SCHEDULER));
+	if (sched == NULL) printf("ERROR: FAILED TO ALLOCATE SCHEDULER!\n");
+
+	sched->lstm = lstm;
+	sched->weights = weights_lstm(lstm);
+	sched->streams = streams;
+	sched->max_batch = max_batch;
+	sched->deadline = deadline;
+	sched->quit = 0;
+	sched->head = NULL;
+	sched->tail = NULL;
+	sched->queued = 0;
+	sched->requests = 0;
+	sched->batch_count = 0;
+	sched->batch_number = 0;
+	sched->latency_count = 0;
+
+	sched->states = (LSTM_STATE **)malloc(streams * sizeof(LSTM_STATE *));
+	sched->last_batch = (long *)calloc(streams, sizeof(long));
+	sched->current = (SCHED_REQUEST **)malloc(max_batch * sizeof(SCHED_REQUEST *));
+	sched->batches = (LSTM_BATCH **)calloc(bucket(max_batch) + 1, sizeof(LSTM_BATCH *)); // created on first use
+	sched->latency = (double *)malloc(SCHED_LATENCY_WINDOW * sizeof(double));
+	if (sched->states == NULL || sched->last_batch == NULL || sched->current == NULL || sched->batches == NULL || sched->latency == NULL) printf("ERROR: FAILED TO ALLOCATE SCHEDULER!\n");
+
+	for (int s = 0; s < streams; s++) {
+		sched->states[s] = create_state_lstm(&sched->weights);
+	}
+
+	// the deadlines are measured on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched->work, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&sched->complete, NULL);
+	pthread_mutex_init(&sched->lock, NULL);
+
+	if (pthread_create(&sched->thread, NULL, scheduler_main, sched) != 0) printf("ERROR: FAILED TO START SCHEDULER THREAD!\n");
+
+	return sched;
+}
+
+void free_scheduler(SCHEDULER *sched) {
+	pthread_mutex_lock(&sched->lock);
+	sched->quit = 1;
+	pthread_cond_signal(&sched->work);
+	pthread_mutex_unlock(&sched->lock);
+	pthread_join(sched->thread, NULL);
+
+	for (int s = 0; s < sched->streams; s++) {
+		free_state_lstm(sched->states[s]);
+	}
+	for (int k = 0; k <= bucket(sched->max_batch); k++) {
+		if (sched->batches[k] != NULL) free_batch_lstm(sched->batches[k]);
+	}
+
+	pthread_mutex_destroy(&sched->lock);
+	pthread_cond_destroy(&sched->work);
+	pthread_cond_destroy(&sched->complete);
+
+	free(sched->states);
+	free(sched->last_batch);
+	free(sched->current);
+	free(sched->batches);
+	free(sched->latency);
+	free(sched);
+}
+
+// 1 if stream is a stream of sched, prints an error otherwise
+static int valid_stream(SCHEDULER *sched, int stream) {
+	if (stream >= 0 && stream < sched->streams) return 1;
+	printf("ERROR: STREAM %d OUT OF RANGE (0 TO %d)!\n", stream, sched->streams - 1);
+	return 0;
+}
+
+void sched_submit(SCHEDULER *sched, SCHED_REQUEST *req) {
+	req->next = NULL;
+
+	// a request for a stream that doesn't exist is done right away without a step, so sched_wait doesn't hang
+	if (!valid_stream(sched, req->stream)) {
+		req->done = 1;
+		return;
+	}
+	req->done = 0;
+
+	pthread_mutex_lock(&sched->lock);
+	req->submitted = now_sec();
+	if (sched->tail != NULL) sched->tail->next = req;
+	else sched->head = req;
+	sched->tail = req;
+	sched->queued++;
+
+	// the scheduler only needs waking up for the first step of a batch and when the batch is full
+	if (sched->queued == 1 || sched->queued >= sched->max_batch) pthread_cond_signal(&sched->work);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_wait(SCHEDULER *sched, SCHED_REQUEST *req) {
+	pthread_mutex_lock(&sched->lock);
+	while (!req->done) pthread_cond_wait(&sched->complete, &sched->lock);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_step(SCHEDULER *sched, int stream, const gsl_vector *x, gsl_vector *y) {
+	if (!valid_stream(sched, stream)) return;
+
+	SCHED_REQUEST req;
+	req.stream = stream;
+	req.x = x;
+	req.y = y;
+
+	sched_submit(sched, &req);
+	sched_wait(sched, &req);
+}
+
+void sched_reset_stream(SCHEDULER *sched, int stream) {
+	if (!valid_stream(sched, stream)) return;
+	reset_state_lstm(sched->states[stream]);
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void sched_stats(SCHEDULER *sched, SCHED_STATS *stats) {
+	pthread_mutex_lock(&sched->lock);
+	int n = sched->latency_count < SCHED_LATENCY_WINDOW ? sched->latency_count : SCHED_LATENCY_WINDOW;
+	double *sorted = (double *)malloc((n > 0 ? n : 1) * sizeof(double));
+	memcpy(sorted, sched->latency, n * sizeof(double));
+	stats->requests = sched->requests;
+	stats->batches = sched->batch_count;
+	pthread_mutex_unlock(&sched->lock);
+
+	qsort(sorted, n, sizeof(double), compare_double);
+	stats->mean_batch = stats->batches > 0 ? (double)stats->requests / stats->batches : 0;
+	stats->p50 = n > 0 ? sorted[(n - 1) / 2] : 0;
+	stats->p99 = n > 0 ? sorted[(long)(n - 1) * 99 / 100] : 0;
+	stats->max = n > 0 ? sorted[n - 1] : 0;
+	free(sorted);
+}
+
+void sched_reset_stats(SCHEDULER *sched) {
+	pthread_mutex_lock(&sched->lock);
+	sched->requests = 0;
+	sched->batch_count = 0;
+	sched->latency_count = 0;
+	pthread_mutex_unlock(&sched->lock);
+}
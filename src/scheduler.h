@@ -0,0 +1,81 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include "lstm.h"
+
+// dynamic batching for inference: many independent streams submit single timesteps, a scheduler thread runs them together.
+// the scheduler waits until max_batch steps are queued or the oldest queued step has waited deadline seconds, then it gathers the inputs and the hidden/cell states of the
+// batch into the columns of an LSTM_BATCH, runs one timestep for all of them with forward_pass_step_batch_lstm (one matrix-matrix product for the gates) and scatters the results back.
+// the state of every stream is an LSTM_STATE on the weights of the lstm (see lstm.h), it can be reset between sequences with sched_reset_stream.
+// steps of the same stream are run in the order they were submitted, never two in the same batch.
+// batches are padded to the next power of 2 columns, so only log2(max_batch) + 1 LSTM_BATCH buffers are needed.
+//
+// usage: sched_step for one blocking step, or sched_submit a request for each stream and sched_wait them (a request must stay valid until sched_wait returns).
+
+// latencies kept for the percentiles of sched_stats (the last SCHED_LATENCY_WINDOW steps)
+#define SCHED_LATENCY_WINDOW 8192
+
+typedef struct SCHED_REQUEST {
+	int stream; // id of the stream, 0 <= stream < number of streams
+	const gsl_vector *x; // input, input_dim
+	gsl_vector *y; // output, output_dim (NULL = the output is only kept in the state of the stream)
+
+	double submitted; // time of sched_submit, seconds
+	int done;
+	struct SCHED_REQUEST *next; // queue
+} SCHED_REQUEST;
+
+typedef struct {
+	long requests; // steps run
+	long batches; // batches run
+	double mean_batch; // mean number of steps per batch
+	double p50; // latency percentiles from submit to completion, seconds
+	double p99;
+	double max;
+} SCHED_STATS;
+
+typedef struct {
+	LSTM *lstm;
+	LSTM_WEIGHTS weights;
+	int streams;
+	LSTM_STATE **states; // one per stream
+
+	// knobs, max_batch is fixed by create_scheduler, deadline can be changed at any time (under lock)
+	int max_batch;
+	double deadline; // maximum time the oldest step waits for the batch to fill, seconds
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work; // signalled when a step is submitted
+	pthread_cond_t complete; // broadcast when a batch is done
+	int quit;
+
+	// queue of submitted steps, oldest first
+	SCHED_REQUEST *head;
+	SCHED_REQUEST *tail;
+	int queued;
+
+	LSTM_BATCH **batches; // batches[k] has 2^k columns
+	SCHED_REQUEST **current; // steps of the running batch
+	long batch_number; // batches taken from the queue so far (never reset)
+	long *last_batch; // number of the last batch each stream was in, to keep the steps of a stream apart
+
+	// statistics
+	long requests;
+	long batch_count;
+	double *latency; // ring buffer of the last SCHED_LATENCY_WINDOW latencies
+	long latency_count;
+} SCHEDULER;
+
+SCHEDULER *create_scheduler(LSTM *lstm, int streams, int max_batch, double deadline); // start a scheduler thread for streams streams of lstm, all states initialized to 0. the lstm must not change while the scheduler runs.
+// returns NULL if streams or max_batch is below 1
+void free_scheduler(SCHEDULER *sched); // stops the thread (steps still queued are dropped), doesn't free the lstm
+void sched_submit(SCHEDULER *sched, SCHED_REQUEST *req); // queue one timestep of req->stream, returns immediately. a stream out of range is an error, the request is done at once without a step
+void sched_wait(SCHEDULER *sched, SCHED_REQUEST *req); // wait until req is done, then req->y and the state of the stream hold the result
+void sched_step(SCHEDULER *sched, int stream, const gsl_vector *x, gsl_vector *y); // sched_submit + sched_wait
+void sched_reset_stream(SCHEDULER *sched, int stream); // zero the state of stream, no step of it may be pending. does nothing (error) for a stream out of range
+void sched_stats(SCHEDULER *sched, SCHED_STATS *stats); // statistics since the creation or the last sched_reset_stats
+void sched_reset_stats(SCHEDULER *sched);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_cblas.h>
+#include "vmath.h"
+#include "instrument.h"
+#include "lstm.h"
+#include "sparse.h"
+
+// the cell equations of the fused forward pass, in double precision
+#define REAL double
+#define VEC gsl_vector
+#define MAT gsl_matrix
+#define TMPL(name) name##_d
+#define CBLAS(name) cblas_d##name
+#define SIGMOID_ARRAY sigmoid_array
+#define TANH_ARRAY tanh_array
+#include "lstm_tmpl.h"
+
+double lstm_sparse_density = LSTM_SPARSE_DENSITY;
+
+static gsl_matrix_view u_view(LSTM *lstm) {
+	return gsl_matrix_submatrix(lstm->wp, 0, lstm->input_dim, 4 * lstm->hidden_dim, lstm->hidden_dim);
+}
+
+// number of nonzero elements of u
+static long count_nonzero(LSTM *lstm) {
+	gsl_matrix_view u = u_view(lstm);
+	long nnz = 0;
+
+	for (size_t r = 0; r < u.matrix.size1; r++) {
+		const double *row = u.matrix.data + r * u.matrix.tda;
+		for (size_t k = 0; k < u.matrix.size2; k++) nnz += row[k] != 0;
+	}
+
+	return nnz;
+}
+
+double density_lstm(LSTM *lstm) {
+	long size = 4L * lstm->hidden_dim * lstm->hidden_dim;
+	return size > 0 ? (double)count_nonzero(lstm) / size : 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// zero the elements of m below the magnitude of its keep-th largest element
+static void prune_matrix(gsl_matrix *m, long keep) {
+	long size = (long)m->size1 * m->size2;
+	if (keep >= size) return;
+
+	double *mag = (double *)malloc(size * sizeof(double));
+	if (mag == NULL) {
+		printf("ERROR: FAILED TO ALLOCATE PRUNING BUFFER!\n");
+		return;
+	}
+
+	for (size_t r = 0; r < m->size1; r++) {
+		for (size_t k = 0; k < m->size2; k++) mag[r * m->size2 + k] = fabs(gsl_matrix_get(m, r, k));
+	}
+	qsort(mag, size, sizeof(double), compare_doubles);
+
+	// everything equal to the threshold is kept, keep = 0 zeroes the whole matrix
+	double threshold = keep > 0 ? mag[size - keep] : INFINITY;
+	for (size_t r = 0; r < m->size1; r++) {
+		for (size_t k = 0; k < m->size2; k++) {
+			if (fabs(gsl_matrix_get(m, r, k)) < threshold) gsl_matrix_set(m, r, k, 0);
+		}
+	}
+
+	free(mag);
+}
+
+double prune_lstm(LSTM *lstm, double density) {
+	gsl_matrix *u[4] = {lstm->uf, lstm->ui, lstm->uo, lstm->uc};
+	long keep = lround(fmin(fmax(density, 0), 1) * lstm->hidden_dim * lstm->hidden_dim);
+
+	for (int k = 0; k < 4; k++) prune_matrix(u[k], keep);
+
+	return density_lstm(lstm);
+}
+
+LSTM_CSR *create_csr(const gsl_matrix *m) {
+	LSTM_CSR *csr = (LSTM_CSR *)malloc(sizeof(LSTM_CSR));
+	if (csr == NULL) printf("ERROR: FAILED TO ALLOCATE CSR MATRIX!\n");
+
+	csr->rows = m->size1;
+	csr->cols = m->size2;
+	csr->nnz = 0;
+	for (size_t r = 0; r < m->size1; r++) {
+		for (size_t k = 0; k < m->size2; k++) csr->nnz += m->data[r * m->tda + k] != 0;
+	}
+
+	csr->row_ptr = (int *)malloc((csr->rows + 1) * sizeof(int));
+	csr->col = (int *)malloc((csr->nnz > 0 ? csr->nnz : 1) * sizeof(int));
+	csr->val = (double *)malloc((csr->nnz > 0 ? csr->nnz : 1) * sizeof(double));
+	if (csr->row_ptr == NULL || csr->col == NULL || csr->val == NULL) printf("ERROR: FAILED TO ALLOCATE CSR MATRIX!\n");
+
+	int j = 0;
+	for (int r = 0; r < csr->rows; r++) {
+		csr->row_ptr[r] = j;
+		const double *row = m->data + r * m->tda;
+		for (int k = 0; k < csr->cols; k++) {
+			if (row[k] == 0) continue;
+			csr->col[j] = k;
+			csr->val[j] = row[k];
+			j++;
+		}
+	}
+	csr->row_ptr[csr->rows] = j;
+
+	return csr;
+}
+
+void free_csr(LSTM_CSR *csr) {
+	free(csr->row_ptr);
+	free(csr->col);
+	free(csr->val);
+	free(csr);
+}
+
+// two sums per row, so the loads of the next element don't wait for the previous add
+void csr_matvec(const LSTM_CSR *a, const double *x, double *y) {
+	for (int r = 0; r < a->rows; r++) {
+		int j = a->row_ptr[r];
+		int end = a->row_ptr[r + 1];
+		double s0 = 0, s1 = 0;
+
+		for (; j + 2 <= end; j += 2) {
+			s0 += a->val[j] * x[a->col[j]];
+			s1 += a->val[j + 1] * x[a->col[j + 1]];
+		}
+		if (j < end) s0 += a->val[j] * x[a->col[j]];
+
+		y[r] += s0 + s1;
+	}
+}
+
+SPARSE_LSTM *create_sparse_lstm(LSTM *lstm) {
+	SPARSE_LSTM *sparse = (SPARSE_LSTM *)malloc(sizeof(SPARSE_LSTM));
+	if (sparse == NULL) printf("ERROR: FAILED TO ALLOCATE SPARSE LSTM!\n");
+
+	sparse->lstm = lstm;
+	sparse->density = density_lstm(lstm);
+	sparse->u = NULL;
+
+	// compared as counts rounded like prune_lstm rounds, so a model pruned to exactly lstm_sparse_density gets the CSR form
+	long size = 4L * lstm->hidden_dim * lstm->hidden_dim;
+	if (count_nonzero(lstm) <= 4 * lround(lstm_sparse_density * size / 4)) {
+		gsl_matrix_view u = u_view(lstm);
+		sparse->u = create_csr(&u.matrix);
+	}
+
+	return sparse;
+}
+
+void free_sparse_lstm(SPARSE_LSTM *sparse) {
+	if (sparse->u != NULL) free_csr(sparse->u);
+	free(sparse);
+}
+
+void forward_pass_sparse_lstm(SPARSE_LSTM *sparse) {
+	LSTM *lstm = sparse->lstm;
+	if (sparse->u == NULL) {
+		forward_pass_lstm(lstm);
+		return;
+	}
+
+	int I = lstm->input_dim, H = lstm->hidden_dim;
+	double *g = lstm->g->data;
+
+	// g = bp + w * x + u * hp, w is the first input_dim columns of wp. the rest of the timestep is the fused forward pass (lstm_tmpl.h)
+	INSTR_BEGIN(INSTR_GATE);
+	memcpy(g, lstm->bp->data, 4 * H * sizeof(double));
+	if (I > 0) cblas_dgemv(CblasRowMajor, CblasNoTrans, 4 * H, I, 1, lstm->wp->data, lstm->wp->tda, lstm->x->data, 1, 1, g, 1);
+	csr_matvec(sparse->u, lstm->hp->data, g);
+	activate_gates_d(lstm->g, H);
+	INSTR_END(INSTR_GATE, 2.0 * (4 * H * I + sparse->u->nnz), 0);
+
+	INSTR_BEGIN(INSTR_CSTATE);
+	state_eqs_d(lstm->g, lstm->cp, lstm->c, lstm->h);
+	INSTR_END(INSTR_CSTATE, 4 * H, 0);
+
+	INSTR_BEGIN(INSTR_OUTPUT);
+	output_d(lstm->wy, lstm->by, lstm->h, lstm->y);
+	INSTR_END(INSTR_OUTPUT, 2 * lstm->wy->size1 * lstm->wy->size2 + lstm->y->size, 0);
+}
+
+void forward_pass_n_sparse_lstm(SPARSE_LSTM *sparse, gsl_vector **arr, int n) {
+	LSTM *lstm = sparse->lstm;
+
+	for (int i = 0; i < n; i++) {
+		gsl_blas_dcopy(arr[i], lstm->x);
+		forward_pass_sparse_lstm(sparse);
+		gsl_blas_dcopy(lstm->h, lstm->hp);
+		gsl_blas_dcopy(lstm->c, lstm->cp);
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "lstm.h"
+
+// sparse recurrent weights, for big hidden_dim where the u * hp products of the gates dominate a timestep.
+// prune_lstm zeroes the smallest weights (by magnitude) of uf, ui, uo and uc in place, down to a target density.
+// a SPARSE_LSTM runs an lstm with the recurrent part of wp (its last hidden_dim columns, [uf; ui; uo; uc]) stored in compressed sparse row (CSR) form:
+// g = bp + w * x (dense, blas) + u * hp (CSR), then the same activations and state equations as the fused forward pass.
+// create_sparse_lstm measures the density of u and only builds the CSR form when it's at most lstm_sparse_density, denser models keep the dense forward pass
+// (a CSR product reads an index for every weight, so it only pays off when most weights are gone).
+//
+// the CSR form is a copy of u when the SPARSE_LSTM is created: after changing the weights of the lstm (i.e training, pruning again) create a new one.
+// the sums of the CSR product run in another order than the dense one, so results differ from forward_pass_lstm in rounding only.
+
+// density at or below which create_sparse_lstm uses the CSR form, measured with the sparse section of the benchmark (hidden_dim 256 to 1024).
+// lstm_sparse_density starts at this value and can be changed at runtime: 0 always keeps the dense forward pass, 1 always uses CSR
+#define LSTM_SPARSE_DENSITY 0.3
+extern double lstm_sparse_density;
+
+typedef struct {
+	int rows;
+	int cols;
+	int nnz; // number of stored (nonzero) elements
+	int *row_ptr; // row r is elements row_ptr[r] to row_ptr[r + 1] - 1 (rows + 1 entries)
+	int *col; // column of each element
+	double *val; // value of each element
+} LSTM_CSR;
+
+typedef struct {
+	LSTM *lstm; // weights and state, the SPARSE_LSTM doesn't own it
+	double density; // density of u measured by create_sparse_lstm
+	LSTM_CSR *u; // [uf; ui; uo; uc] in CSR form, (4 * hidden_dim) x hidden_dim. NULL when the dense forward pass is used
+} SPARSE_LSTM;
+
+double density_lstm(LSTM *lstm); // fraction of nonzero weights in uf, ui, uo and uc
+double prune_lstm(LSTM *lstm, double density); // zero all but the largest weights (by magnitude) of each of uf, ui, uo and uc, keeping density of each matrix. returns the density reached (ties can keep a few more)
+LSTM_CSR *create_csr(const gsl_matrix *m); // CSR form of the nonzero elements of m
+void free_csr(LSTM_CSR *csr);
+void csr_matvec(const LSTM_CSR *a, const double *x, double *y); // y = y + a * x
+SPARSE_LSTM *create_sparse_lstm(LSTM *lstm); // measure the density of u and pick the dense or the CSR forward pass
+void free_sparse_lstm(SPARSE_LSTM *sparse); // doesn't free the lstm
+void forward_pass_sparse_lstm(SPARSE_LSTM *sparse); // same as forward_pass_lstm on sparse->lstm
+void forward_pass_n_sparse_lstm(SPARSE_LSTM *sparse, gsl_vector **arr, int n); // same as forward_pass_n_lstm on sparse->lstm
+
+#endif
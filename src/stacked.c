@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include "stacked.h"
+#include "lstm.h"
+
+// timestep t of layer l: its input is arr[t] for the first layer, else the output of layer l - 1 at timestep t (written in the previous wave)
+static void layer_step(STACKED_LSTM *stack, int l, int t) {
+	LSTM *lstm = stack->lstm[l];
+	gsl_vector_view in;
+
+	if (l == 0) in.vector = *stack->arr[t];
+	else in = gsl_matrix_row(stack->out[l - 1], t % 2);
+
+	gsl_vector *x = &in.vector;
+	forward_pass_n_lstm(lstm, &x, 1);
+
+	if (l < stack->layers - 1) {
+		gsl_vector_view o = gsl_matrix_row(stack->out[l], t % 2);
+		gsl_blas_dcopy(lstm->h, &o.vector);
+	}
+}
+
+static void run_waves(STACKED_WORKER *w) {
+	STACKED_LSTM *stack = w->stack;
+	int waves = stack->n + stack->layers - 1;
+
+	for (int wave = 0; wave < waves; wave++) {
+		for (int l = w->id; l < stack->layers; l += stack->threads) {
+			int t = wave - l;
+			if (t >= 0 && t < stack->n) layer_step(stack, l, t);
+		}
+		pthread_barrier_wait(&stack->barrier);
+	}
+}
+
+static void *worker_main(void *arg) {
+	STACKED_WORKER *w = (STACKED_WORKER *)arg;
+	STACKED_LSTM *stack = w->stack;
+	long seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&stack->lock);
+		while (stack->job == seen && !stack->quit) pthread_cond_wait(&stack->start, &stack->lock);
+		if (stack->quit) {
+			pthread_mutex_unlock(&stack->lock);
+			return NULL;
+		}
+		seen = stack->job;
+		pthread_mutex_unlock(&stack->lock);
+
+		run_waves(w);
+
+		pthread_mutex_lock(&stack->lock);
+		if (--stack->running == 0) pthread_cond_signal(&stack->done);
+		pthread_mutex_unlock(&stack->lock);
+	}
+}
+
+STACKED_LSTM *create_stacked_lstm(LSTM **layers, int count, int threads) {
+	STACKED_LSTM *stack = (STACKED_LSTM *)malloc(sizeof(STACKED_LSTM));
+	if (stack == NULL) printf("ERROR: FAILED TO ALLOCATE STACKED LSTM!\n");
+
+	// 1 <= threads <= count: the barrier needs a thread, and the wavefront hands every thread its own layers
+	if (threads > count) threads = count;
+	if (threads < 1) threads = 1;
+
+	stack->layers = count;
+	stack->threads = threads;
+	stack->job = 0;
+	stack->running = 0;
+	stack->quit = 0;
+	stack->arr = NULL;
+	stack->n = 0;
+
+	stack->lstm = (LSTM **)malloc(count * sizeof(LSTM *));
+	stack->out = (gsl_matrix **)malloc(count * sizeof(gsl_matrix *));
+	if (stack->lstm == NULL || stack->out == NULL) printf("ERROR: FAILED TO ALLOCATE STACKED LSTM!\n");
+
+	for (int l = 0; l < count; l++) {
+		if (l > 0 && layers[l]->input_dim != layers[l - 1]->hidden_dim) printf("ERROR: INPUT_DIM OF LAYER %d DOESN'T MATCH HIDDEN_DIM OF LAYER %d!\n", l, l - 1);
+		stack->lstm[l] = layers[l];
+		stack->out[l] = gsl_matrix_calloc(2, layers[l]->hidden_dim);
+	}
+
+	pthread_mutex_init(&stack->lock, NULL);
+	pthread_cond_init(&stack->start, NULL);
+	pthread_cond_init(&stack->done, NULL);
+	pthread_barrier_init(&stack->barrier, NULL, threads);
+
+	stack->workers = (STACKED_WORKER *)malloc(threads * sizeof(STACKED_WORKER));
+	if (stack->workers == NULL) printf("ERROR: FAILED TO ALLOCATE STACKED LSTM WORKERS!\n");
+
+	for (int i = 0; i < threads; i++) {
+		stack->workers[i].id = i;
+		stack->workers[i].stack = stack;
+	}
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&stack->workers[i].thread, NULL, worker_main, &stack->workers[i]) != 0) printf("ERROR: FAILED TO START STACKED LSTM THREAD!\n");
+	}
+
+	return stack;
+}
+
+void free_stacked_lstm(STACKED_LSTM *stack) {
+	pthread_mutex_lock(&stack->lock);
+	stack->quit = 1;
+	pthread_cond_broadcast(&stack->start);
+	pthread_mutex_unlock(&stack->lock);
+
+	for (int i = 0; i < stack->threads; i++) {
+		pthread_join(stack->workers[i].thread, NULL);
+	}
+	for (int l = 0; l < stack->layers; l++) {
+		gsl_matrix_free(stack->out[l]);
+	}
+
+	pthread_mutex_destroy(&stack->lock);
+	pthread_cond_destroy(&stack->start);
+	pthread_cond_destroy(&stack->done);
+	pthread_barrier_destroy(&stack->barrier);
+
+	free(stack->workers);
+	free(stack->out);
+	free(stack->lstm);
+	free(stack);
+}
+
+void forward_pass_stacked_lstm(STACKED_LSTM *stack, gsl_vector **arr, int n) {
+	if (n <= 0) return;
+
+	// post the series and wait for every worker to finish its last wave
+	pthread_mutex_lock(&stack->lock);
+	stack->arr = arr;
+	stack->n = n;
+	stack->running = stack->threads;
+	stack->job++;
+	pthread_cond_broadcast(&stack->start);
+	while (stack->running > 0) pthread_cond_wait(&stack->done, &stack->lock);
+	pthread_mutex_unlock(&stack->lock);
+}
+
+void reset_stacked_lstm(STACKED_LSTM *stack) {
+	for (int l = 0; l < stack->layers; l++) {
+		gsl_vector_set_zero(stack->lstm[l]->hp);
+		gsl_vector_set_zero(stack->lstm[l]->cp);
+	}
+}
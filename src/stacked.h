@@ -0,0 +1,51 @@
+#ifndef STACKED_H
+#define STACKED_H
+
+#include <pthread.h>
+#include "lstm.h"
+
+// stacked (multi-layer) lstm built from normal LSTM cells: the hidden state h of layer l is the input x of layer l + 1, the output of the stack is y of the last layer
+// (the output layers wy, by of the other layers aren't used).
+//
+// the forward pass runs as a diagonal wavefront on a pool of threads: in wave w, layer l computes timestep w - l, so all the layers work at the same time,
+// layer l + 1 one timestep behind layer l. a series of n timesteps through L layers takes n + L - 1 waves instead of n * L steps, with a barrier between waves.
+// the layers are split over the threads round robin (layer l runs on thread l % threads), so threads = layers gives the full speedup when there is a core per thread.
+// on a single thread the wavefront is slower than running the layers one after the other, as every wave touches the weights of all the layers.
+// every layer keeps its last two h vectors in a ring (out), layer l + 1 reads the one layer l wrote in the previous wave while layer l writes the other one.
+
+struct STACKED_LSTM;
+
+// one thread of the pool
+typedef struct {
+	int id;
+	struct STACKED_LSTM *stack;
+	pthread_t thread;
+} STACKED_WORKER;
+
+typedef struct STACKED_LSTM {
+	int layers;
+	LSTM **lstm; // the layers, lstm[l]->input_dim = lstm[l - 1]->hidden_dim
+	gsl_matrix **out; // out[l] = 2 x hidden_dim of layer l, ring of its outputs (row t % 2 = h of timestep t)
+
+	int threads;
+	STACKED_WORKER *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start; // signalled when a series is posted
+	pthread_cond_t done; // signalled when the last worker finished a series
+	pthread_barrier_t barrier; // separates the waves
+	long job; // number of series posted so far, workers wait for it to change
+	int running; // workers still busy with the current series
+	int quit;
+
+	// current series
+	gsl_vector **arr;
+	int n;
+} STACKED_LSTM;
+
+STACKED_LSTM *create_stacked_lstm(LSTM **layers, int count, int threads); // stack count layers (the array is copied, not the lstms) and start threads threads (clamped to 1..count)
+void free_stacked_lstm(STACKED_LSTM *stack); // stops the threads, doesn't free the layers
+void forward_pass_stacked_lstm(STACKED_LSTM *stack, gsl_vector **arr, int n); // same as forward_pass_n_lstm for the whole stack: n timesteps, the states of every layer carry over to the next call.
+// afterwards stack->lstm[stack->layers - 1]->y holds the output of the last timestep
+void reset_stacked_lstm(STACKED_LSTM *stack); // zero the hidden and cell states of every layer
+
+#endif
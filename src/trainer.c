@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include "trainer.h"
+#include "backprop.h"
+#include "lstm.h"
+#include "optimizer.h"
+
+// copy the parameters of src into dst, the packed blocks hold all the gate weights and biases
+static void copy_weights(LSTM *dst, LSTM *src) {
+	gsl_matrix_memcpy(dst->wp, src->wp);
+	gsl_vector_memcpy(dst->bp, src->bp);
+	gsl_matrix_memcpy(dst->wy, src->wy);
+	gsl_vector_memcpy(dst->by, src->by);
+}
+
+// gradients of one worker's shard of the current batch, then its part of the reduction
+static void run_shard(TRAINER_WORKER *w) {
+	TRAINER *trainer = w->trainer;
+	LSTM *lstm = w->lstm;
+	int first = (long)trainer->size * w->id / trainer->threads;
+	int last = (long)trainer->size * (w->id + 1) / trainer->threads;
+
+	copy_weights(lstm, trainer->lstm);
+	bp_zero_cxt(w->cxt);
+
+	if (w->tape == NULL || w->tape->rows < trainer->n - 1) {
+		if (w->tape != NULL) bp_delete_tape(w->tape);
+		w->tape = bp_create_tape(lstm, trainer->n - 1);
+	}
+
+	for (int b = first; b < last; b++) {
+		gsl_vector_set_zero(lstm->hp);
+		gsl_vector_set_zero(lstm->cp);
+		bp_accumulate_lstm(lstm, w->tape, trainer->batch[b], trainer->n, w->cxt);
+	}
+
+	// tree reduction: in the round with distance d, worker id adds the context of worker id + d, so worker 0 ends up with the sum
+	for (int d = 1; d < trainer->threads; d *= 2) {
+		pthread_barrier_wait(&trainer->barrier);
+		if (w->id % (2 * d) == 0 && w->id + d < trainer->threads) {
+			bp_add_cxt(w->cxt, trainer->workers[w->id + d].cxt);
+		}
+	}
+}
+
+// hogwild: one step on the shared lstm after every series of the shard, nothing is locked
+static void run_hogwild(TRAINER_WORKER *w) {
+	TRAINER *trainer = w->trainer;
+	LSTM *lstm = w->lstm;
+	int first = (long)trainer->size * w->id / trainer->threads;
+	int last = (long)trainer->size * (w->id + 1) / trainer->threads;
+
+	if (w->tape == NULL || w->tape->rows < trainer->n - 1) {
+		if (w->tape != NULL) bp_delete_tape(w->tape);
+		w->tape = bp_create_tape(lstm, trainer->n - 1);
+	}
+
+	w->E = 0;
+	for (int b = first; b < last; b++) {
+		copy_weights(lstm, trainer->lstm); // may see other workers' updates half applied
+		gsl_vector_set_zero(lstm->hp);
+		gsl_vector_set_zero(lstm->cp);
+
+		bp_zero_cxt(w->cxt);
+		w->E += bp_accumulate_lstm(lstm, w->tape, trainer->batch[b], trainer->n, w->cxt);
+		bp_learn_gates_cxt(trainer->lstm, w->cxt); // racy read-modify-write of the shared weights, gate by gate
+	}
+}
+
+static void *worker_main(void *arg) {
+	TRAINER_WORKER *w = (TRAINER_WORKER *)arg;
+	TRAINER *trainer = w->trainer;
+	long seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&trainer->lock);
+		while (trainer->job == seen && !trainer->quit) pthread_cond_wait(&trainer->start, &trainer->lock);
+		if (trainer->quit) {
+			pthread_mutex_unlock(&trainer->lock);
+			return NULL;
+		}
+		seen = trainer->job;
+		pthread_mutex_unlock(&trainer->lock);
+
+		if (trainer->mode == TRAIN_HOGWILD) run_hogwild(w);
+		else run_shard(w);
+
+		pthread_mutex_lock(&trainer->lock);
+		if (--trainer->running == 0) pthread_cond_signal(&trainer->done);
+		pthread_mutex_unlock(&trainer->lock);
+	}
+}
+
+TRAINER *create_trainer(LSTM *lstm, int threads) {
+	TRAINER *trainer = (TRAINER *)malloc(sizeof(TRAINER));
+	if (trainer == NULL) printf("ERROR: FAILED TO ALLOCATE TRAINER!\n");
+
+	// the barrier and the shards need at least one worker
+	if (threads < 1) threads = 1;
+
+	trainer->lstm = lstm;
+	trainer->opt = NULL;
+	trainer->threads = threads;
+	trainer->job = 0;
+	trainer->running = 0;
+	trainer->quit = 0;
+	trainer->mode = TRAIN_SYNC;
+	trainer->batch = NULL;
+	trainer->size = 0;
+	trainer->n = 0;
+
+	pthread_mutex_init(&trainer->lock, NULL);
+	pthread_cond_init(&trainer->start, NULL);
+	pthread_cond_init(&trainer->done, NULL);
+	pthread_barrier_init(&trainer->barrier, NULL, threads);
+
+	trainer->workers = (TRAINER_WORKER *)malloc(threads * sizeof(TRAINER_WORKER));
+	if (trainer->workers == NULL) printf("ERROR: FAILED TO ALLOCATE TRAINER WORKERS!\n");
+
+	// everything a worker owns is allocated before any thread starts, the reduction reads the contexts of other workers
+	for (int i = 0; i < threads; i++) {
+		TRAINER_WORKER *w = &trainer->workers[i];
+		w->id = i;
+		w->trainer = trainer;
+		w->lstm = clone_lstm(lstm);
+		w->tape = NULL;
+		w->cxt = bp_create_cxt(lstm);
+		w->E = 0;
+	}
+
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&trainer->workers[i].thread, NULL, worker_main, &trainer->workers[i]) != 0) printf("ERROR: FAILED TO START TRAINER THREAD!\n");
+	}
+
+	return trainer;
+}
+
+void free_trainer(TRAINER *trainer) {
+	pthread_mutex_lock(&trainer->lock);
+	trainer->quit = 1;
+	pthread_cond_broadcast(&trainer->start);
+	pthread_mutex_unlock(&trainer->lock);
+
+	for (int i = 0; i < trainer->threads; i++) {
+		TRAINER_WORKER *w = &trainer->workers[i];
+		pthread_join(w->thread, NULL);
+
+		free_lstm(w->lstm);
+		if (w->tape != NULL) bp_delete_tape(w->tape);
+		bp_delete_cxt(w->cxt);
+	}
+
+	pthread_mutex_destroy(&trainer->lock);
+	pthread_cond_destroy(&trainer->start);
+	pthread_cond_destroy(&trainer->done);
+	pthread_barrier_destroy(&trainer->barrier);
+
+	free(trainer->workers);
+	free(trainer);
+}
+
+// post a batch and wait for every worker to finish it
+static void run_job(TRAINER *trainer, TRAIN_MODE mode, gsl_vector ***batch, int size, int n) {
+	pthread_mutex_lock(&trainer->lock);
+	trainer->mode = mode;
+	trainer->batch = batch;
+	trainer->size = size;
+	trainer->n = n;
+	trainer->running = trainer->threads;
+	trainer->job++;
+	pthread_cond_broadcast(&trainer->start);
+	while (trainer->running > 0) pthread_cond_wait(&trainer->done, &trainer->lock);
+	pthread_mutex_unlock(&trainer->lock);
+}
+
+double train_batch(TRAINER *trainer, gsl_vector ***batch, int size, int n) {
+	// an empty batch has no mean gradient, the weights are left alone. a series needs at least one input and one target
+	if (size <= 0 || n < 2) return 0;
+
+	// every worker finishes its shard and the reduction before run_job returns
+	run_job(trainer, TRAIN_SYNC, batch, size, n);
+
+	BCKPROP_CXT *cxt = trainer->workers[0].cxt;
+	bp_scale_cxt(cxt, 1.0 / size);
+	if (trainer->opt != NULL) step_optimizer(trainer->opt, trainer->lstm, cxt);
+	else bp_learn_cxt(trainer->lstm, cxt);
+
+	return cxt->E;
+}
+
+double train_hogwild(TRAINER *trainer, gsl_vector ***batch, int size, int n) {
+	if (size <= 0 || n < 2) return 0;
+
+	run_job(trainer, TRAIN_HOGWILD, batch, size, n);
+
+	double E = 0;
+	for (int i = 0; i < trainer->threads; i++) E += trainer->workers[i].E;
+	return E / size;
+}
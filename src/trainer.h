@@ -0,0 +1,62 @@
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include <pthread.h>
+#include "lstm.h"
+#include "backprop.h"
+
+// data parallel training on a pool of threads.
+// a mini-batch of series is split into one shard per thread. every thread backpropagates its shard with its own copy of the lstm state, its own activation tape and its own BCKPROP_CXT,
+// then the contexts are summed with a tree reduction (log2(threads) rounds, all pairs of a round in parallel) and the lstm takes one gradient descent step.
+// the threads are started once in create_trainer and sleep between batches.
+//
+// hogwild mode (train_hogwild) skips the reduction: every thread takes a gradient descent step on the shared lstm after each series of its shard, without any locking.
+// the step goes through the per gate updates (bp_lWg, bp_lUg and bp_lbg of every gate, see bp_learn_gates_cxt), plain sgd with the same result as bp_learn_cxt.
+// the workers read and write the shared weights while others are updating them (racy by design), an update can be partially lost or mixed with another one.
+// for small models the synchronization of the reduction costs more than it saves, and sgd tolerates these sparse conflicts well.
+// the result isn't deterministic, and it's not the same as train_batch: there is one step per series instead of one per batch.
+
+struct TRAINER;
+
+typedef enum {TRAIN_SYNC, TRAIN_HOGWILD} TRAIN_MODE;
+
+// one thread of the pool
+typedef struct {
+	int id;
+	struct TRAINER *trainer;
+	pthread_t thread;
+	LSTM *lstm; // private copy of the lstm, the weights are copied from the trained lstm at the start of every batch (of every series in hogwild mode)
+	BP_TAPE *tape; // activation tape, grown when a batch has longer series
+	BCKPROP_CXT *cxt; // gradients of this thread's shard
+	double E; // loss of this thread's shard (hogwild)
+} TRAINER_WORKER;
+
+typedef struct TRAINER {
+	LSTM *lstm; // the trained lstm
+	struct OPTIMIZER *opt; // optimizer for the steps of train_batch (see optimizer.h), NULL = plain sgd with bp_learn_cxt. hogwild always uses plain sgd
+	int threads;
+	TRAINER_WORKER *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start; // signalled when a batch is posted
+	pthread_cond_t done; // signalled when the last worker finished a batch
+	pthread_barrier_t barrier; // separates the rounds of the reduction
+	long job; // number of batches posted so far, workers wait for it to change
+	int running; // workers still busy with the current batch
+	int quit;
+
+	// current batch
+	TRAIN_MODE mode;
+	gsl_vector ***batch;
+	int size;
+	int n;
+} TRAINER;
+
+TRAINER *create_trainer(LSTM *lstm, int threads); // create a pool of threads training lstm (output_dim has to equal input_dim, like bp_series_lstm), threads < 1 is taken as 1
+void free_trainer(TRAINER *trainer); // stops the threads, doesn't free the lstm
+double train_batch(TRAINER *trainer, gsl_vector ***batch, int size, int n); // one gradient descent step over size series of n vectors (batch[b][t] = element t of series b).
+// every series starts from a zero state. the gradients and the returned loss are averaged over the series, so the step size doesn't depend on the batch size.
+// an empty batch (size <= 0) or series too short to have a target (n < 2) return 0 without a step, the same for train_hogwild
+double train_hogwild(TRAINER *trainer, gsl_vector ***batch, int size, int n); // one pass over the batch in hogwild mode, size gradient descent steps in total. returns the mean loss of the series
+
+#endif
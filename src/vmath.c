@@ -0,0 +1,368 @@
+#include <stdint.h>
+#include <string.h>
+#include "vmath.h"
+
+// the kernels below are written once against a small set of vd_* operations on a "vector of doubles" type vd.
+// vd is an AVX2 register, an SSE2 register or a plain double depending on what the compiler is allowed to use.
+// the float kernels work the same way with vf_* operations on a "vector of floats" type vf.
+
+// constants
+#define VM_LOG2E 1.4426950408889634074
+#define VM_LN2_HI 6.93145751953125e-1 // ln2 split in two, so that n * VM_LN2_HI is exact
+#define VM_LN2_LO 1.42860682030941723212e-6
+#define VM_MAGIC 6755399441055744.0 // 1.5 * 2^52, adding it rounds a double to an integer which ends up in the low mantissa bits
+
+#define VM_LOG2EF 1.44269504088896341f
+#define VM_LN2_HIF 0.693359375f
+#define VM_LN2_LOF -2.12194440e-4f
+#define VM_MAGICF 12582912.0f // 1.5 * 2^23, same as VM_MAGIC for floats
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+typedef __m256d vd;
+#define VD_LANES 4
+#define VD_ISA "avx2"
+
+#define vd_set1 _mm256_set1_pd
+#define vd_load _mm256_loadu_pd
+#define vd_store _mm256_storeu_pd
+#define vd_add _mm256_add_pd
+#define vd_sub _mm256_sub_pd
+#define vd_mul _mm256_mul_pd
+#define vd_div _mm256_div_pd
+#define vd_min _mm256_min_pd
+#define vd_max _mm256_max_pd
+#define vd_and _mm256_and_pd
+#define vd_andnot _mm256_andnot_pd
+#define vd_or _mm256_or_pd
+#define vd_cmplt(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define vd_isnan(a) _mm256_cmp_pd(a, a, _CMP_UNORD_Q)
+
+// adds VM_MAGIC, which rounds a to an integer n that ends up in the low mantissa bits
+static inline vd vd_add_magic(vd a) {
+	return _mm256_add_pd(a, _mm256_set1_pd(VM_MAGIC));
+}
+
+// 2^n, where nd = vd_add_magic(n)
+static inline vd vd_pow2n(vd nd) {
+	__m256i e = _mm256_add_epi64(_mm256_castpd_si256(nd), _mm256_set1_epi64x(1023));
+	return _mm256_castsi256_pd(_mm256_slli_epi64(e, 52));
+}
+
+typedef __m256 vf;
+#define VF_LANES 8
+
+#define vf_set1 _mm256_set1_ps
+#define vf_load _mm256_loadu_ps
+#define vf_store _mm256_storeu_ps
+#define vf_add _mm256_add_ps
+#define vf_sub _mm256_sub_ps
+#define vf_mul _mm256_mul_ps
+#define vf_div _mm256_div_ps
+#define vf_min _mm256_min_ps
+#define vf_max _mm256_max_ps
+#define vf_and _mm256_and_ps
+#define vf_andnot _mm256_andnot_ps
+#define vf_or _mm256_or_ps
+#define vf_cmplt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vf_isnan(a) _mm256_cmp_ps(a, a, _CMP_UNORD_Q)
+
+static inline vf vf_add_magic(vf a) {
+	return _mm256_add_ps(a, _mm256_set1_ps(VM_MAGICF));
+}
+
+static inline vf vf_pow2n(vf nd) {
+	__m256i e = _mm256_add_epi32(_mm256_castps_si256(nd), _mm256_set1_epi32(127));
+	return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128d vd;
+#define VD_LANES 2
+#define VD_ISA "sse2"
+
+#define vd_set1 _mm_set1_pd
+#define vd_load _mm_loadu_pd
+#define vd_store _mm_storeu_pd
+#define vd_add _mm_add_pd
+#define vd_sub _mm_sub_pd
+#define vd_mul _mm_mul_pd
+#define vd_div _mm_div_pd
+#define vd_min _mm_min_pd
+#define vd_max _mm_max_pd
+#define vd_and _mm_and_pd
+#define vd_andnot _mm_andnot_pd
+#define vd_or _mm_or_pd
+#define vd_cmplt _mm_cmplt_pd
+#define vd_isnan(a) _mm_cmpunord_pd(a, a)
+
+static inline vd vd_add_magic(vd a) {
+	return _mm_add_pd(a, _mm_set1_pd(VM_MAGIC));
+}
+
+static inline vd vd_pow2n(vd nd) {
+	__m128i e = _mm_add_epi64(_mm_castpd_si128(nd), _mm_set1_epi64x(1023));
+	return _mm_castsi128_pd(_mm_slli_epi64(e, 52));
+}
+
+typedef __m128 vf;
+#define VF_LANES 4
+
+#define vf_set1 _mm_set1_ps
+#define vf_load _mm_loadu_ps
+#define vf_store _mm_storeu_ps
+#define vf_add _mm_add_ps
+#define vf_sub _mm_sub_ps
+#define vf_mul _mm_mul_ps
+#define vf_div _mm_div_ps
+#define vf_min _mm_min_ps
+#define vf_max _mm_max_ps
+#define vf_and _mm_and_ps
+#define vf_andnot _mm_andnot_ps
+#define vf_or _mm_or_ps
+#define vf_cmplt _mm_cmplt_ps
+#define vf_isnan(a) _mm_cmpunord_ps(a, a)
+
+static inline vf vf_add_magic(vf a) {
+	return _mm_add_ps(a, _mm_set1_ps(VM_MAGICF));
+}
+
+static inline vf vf_pow2n(vf nd) {
+	__m128i e = _mm_add_epi32(_mm_castps_si128(nd), _mm_set1_epi32(127));
+	return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+}
+
+#else
+#include <math.h>
+
+typedef double vd;
+#define VD_LANES 1
+#define VD_ISA "scalar"
+
+static inline uint64_t vd_bits(double a) { uint64_t u; memcpy(&u, &a, sizeof(u)); return u; }
+static inline double vd_double(uint64_t u) { double a; memcpy(&a, &u, sizeof(a)); return a; }
+
+static inline vd vd_set1(double a) { return a; }
+static inline vd vd_load(const double *p) { return *p; }
+static inline void vd_store(double *p, vd a) { *p = a; }
+static inline vd vd_add(vd a, vd b) { return a + b; }
+static inline vd vd_sub(vd a, vd b) { return a - b; }
+static inline vd vd_mul(vd a, vd b) { return a * b; }
+static inline vd vd_div(vd a, vd b) { return a / b; }
+static inline vd vd_min(vd a, vd b) { return a < b ? a : b; }
+static inline vd vd_max(vd a, vd b) { return a > b ? a : b; }
+static inline vd vd_and(vd a, vd b) { return vd_double(vd_bits(a) & vd_bits(b)); }
+static inline vd vd_andnot(vd a, vd b) { return vd_double(~vd_bits(a) & vd_bits(b)); }
+static inline vd vd_or(vd a, vd b) { return vd_double(vd_bits(a) | vd_bits(b)); }
+static inline vd vd_cmplt(vd a, vd b) { return vd_double(a < b ? ~(uint64_t)0 : 0); }
+static inline vd vd_isnan(vd a) { return vd_double(a != a ? ~(uint64_t)0 : 0); }
+
+// without SSE the compiler may keep a + VM_MAGIC in extended precision, which doesn't round. so the integer is rounded explicitly first
+static inline vd vd_add_magic(vd a) {
+	return nearbyint(a) + VM_MAGIC;
+}
+
+static inline vd vd_pow2n(vd nd) {
+	return vd_double((vd_bits(nd) + 1023) << 52);
+}
+
+typedef float vf;
+#define VF_LANES 1
+
+static inline uint32_t vf_bits(float a) { uint32_t u; memcpy(&u, &a, sizeof(u)); return u; }
+static inline float vf_float(uint32_t u) { float a; memcpy(&a, &u, sizeof(a)); return a; }
+
+static inline vf vf_set1(float a) { return a; }
+static inline vf vf_load(const float *p) { return *p; }
+static inline void vf_store(float *p, vf a) { *p = a; }
+static inline vf vf_add(vf a, vf b) { return a + b; }
+static inline vf vf_sub(vf a, vf b) { return a - b; }
+static inline vf vf_mul(vf a, vf b) { return a * b; }
+static inline vf vf_div(vf a, vf b) { return a / b; }
+static inline vf vf_min(vf a, vf b) { return a < b ? a : b; }
+static inline vf vf_max(vf a, vf b) { return a > b ? a : b; }
+static inline vf vf_and(vf a, vf b) { return vf_float(vf_bits(a) & vf_bits(b)); }
+static inline vf vf_andnot(vf a, vf b) { return vf_float(~vf_bits(a) & vf_bits(b)); }
+static inline vf vf_or(vf a, vf b) { return vf_float(vf_bits(a) | vf_bits(b)); }
+static inline vf vf_cmplt(vf a, vf b) { return vf_float(a < b ? ~(uint32_t)0 : 0); }
+static inline vf vf_isnan(vf a) { return vf_float(a != a ? ~(uint32_t)0 : 0); }
+
+static inline vf vf_add_magic(vf a) {
+	return nearbyintf(a) + VM_MAGICF;
+}
+
+static inline vf vf_pow2n(vf nd) {
+	return vf_float((vf_bits(nd) + 127) << 23);
+}
+
+#endif
+
+static inline vd vd_abs(vd a) {
+	return vd_andnot(vd_set1(-0.0), a);
+}
+
+// per element: mask ? a : b (mask comes from a vd_cmp* function)
+static inline vd vd_select(vd mask, vd a, vd b) {
+	return vd_or(vd_and(mask, a), vd_andnot(mask, b));
+}
+
+static inline vd vd_exp(vd v) {
+	// min/max would turn a NaN into one of the bounds, NaN lanes are put back at the end so they propagate like in libm
+	vd x = vd_min(vd_max(v, vd_set1(VM_EXP_MIN)), vd_set1(VM_EXP_MAX));
+
+	// x = n * ln2 + r
+	vd nd = vd_add_magic(vd_mul(x, vd_set1(VM_LOG2E)));
+	vd n = vd_sub(nd, vd_set1(VM_MAGIC));
+	vd r = vd_sub(vd_sub(x, vd_mul(n, vd_set1(VM_LN2_HI))), vd_mul(n, vd_set1(VM_LN2_LO)));
+
+	// e^r, taylor polynomial of degree 12 (coefficients 1/k!) in horner form
+	vd p = vd_set1(2.08767569878680989792e-9);
+	p = vd_add(vd_mul(p, r), vd_set1(2.50521083854417187751e-8));
+	p = vd_add(vd_mul(p, r), vd_set1(2.75573192239858906526e-7));
+	p = vd_add(vd_mul(p, r), vd_set1(2.75573192239858906526e-6));
+	p = vd_add(vd_mul(p, r), vd_set1(2.48015873015873015873e-5));
+	p = vd_add(vd_mul(p, r), vd_set1(1.98412698412698412698e-4));
+	p = vd_add(vd_mul(p, r), vd_set1(1.38888888888888888889e-3));
+	p = vd_add(vd_mul(p, r), vd_set1(8.33333333333333333333e-3));
+	p = vd_add(vd_mul(p, r), vd_set1(4.16666666666666666667e-2));
+	p = vd_add(vd_mul(p, r), vd_set1(1.66666666666666666667e-1));
+	p = vd_add(vd_mul(p, r), vd_set1(0.5));
+	p = vd_add(vd_mul(p, r), vd_set1(1.0));
+	p = vd_add(vd_mul(p, r), vd_set1(1.0));
+
+	return vd_select(vd_isnan(v), v, vd_mul(p, vd_pow2n(nd)));
+}
+
+static inline vd vd_sigmoid(vd x) {
+	vd one = vd_set1(1.0);
+	return vd_div(one, vd_add(one, vd_exp(vd_sub(vd_set1(0.0), x))));
+}
+
+static inline vd vd_tanh(vd x) {
+	vd one = vd_set1(1.0);
+	vd ax = vd_abs(x);
+
+	// large |x|: tanh(|x|) = (1 - e) / (1 + e) with e = e^-2|x| (so e never overflows), then the sign of x is put back
+	vd sign = vd_and(x, vd_set1(-0.0));
+	vd e = vd_exp(vd_mul(ax, vd_set1(-2.0)));
+	vd tl = vd_or(vd_div(vd_sub(one, e), vd_add(one, e)), sign);
+
+	// small |x| (< 0.625): 1 - e cancels, so use the rational approximation tanh(x) = x + x * s * P(s) / Q(s), s = x^2 (from cephes)
+	vd s2 = vd_mul(x, x);
+	vd p = vd_set1(-9.64399179425052238628e-1);
+	p = vd_add(vd_mul(p, s2), vd_set1(-9.92877231001918586564e1));
+	p = vd_add(vd_mul(p, s2), vd_set1(-1.61468768441708447952e3));
+	vd q = vd_add(s2, vd_set1(1.12811678491632931402e2));
+	q = vd_add(vd_mul(q, s2), vd_set1(2.23548839060100448583e3));
+	q = vd_add(vd_mul(q, s2), vd_set1(4.84406305325125486048e3));
+	vd ts = vd_add(x, vd_mul(vd_mul(x, s2), vd_div(p, q)));
+
+	return vd_select(vd_cmplt(ax, vd_set1(0.625)), ts, tl);
+}
+
+static inline vd vd_sech(vd x) {
+	// sech(x) = 2 / (e^x + e^-x) = 2e / (1 + e^2) with e = e^-|x|
+	vd e = vd_exp(vd_sub(vd_set1(0.0), vd_abs(x)));
+	return vd_div(vd_add(e, e), vd_add(vd_set1(1.0), vd_mul(e, e)));
+}
+
+// runs kernel f over an array. the last n % VD_LANES elements go through a zero-padded buffer, so they get the same algorithm as the rest.
+#define VM_ARRAY_KERNEL(name, f) \
+	void name(const double *v, double *r, int n) { \
+		int k = 0; \
+		for (; k + VD_LANES <= n; k += VD_LANES) { \
+			vd_store(r + k, f(vd_load(v + k))); \
+		} \
+		if (k < n) { \
+			double buf[VD_LANES] = {0}; \
+			memcpy(buf, v + k, (n - k) * sizeof(double)); \
+			vd_store(buf, f(vd_load(buf))); \
+			memcpy(r + k, buf, (n - k) * sizeof(double)); \
+		} \
+	}
+
+VM_ARRAY_KERNEL(exp_array, vd_exp)
+VM_ARRAY_KERNEL(sigmoid_array, vd_sigmoid)
+VM_ARRAY_KERNEL(tanh_array, vd_tanh)
+VM_ARRAY_KERNEL(sech_array, vd_sech)
+
+// float kernels, same algorithms as above with polynomials of lower degree (from cephes expf and tanhf)
+
+static inline vf vf_abs(vf a) {
+	return vf_andnot(vf_set1(-0.0f), a);
+}
+
+static inline vf vf_select(vf mask, vf a, vf b) {
+	return vf_or(vf_and(mask, a), vf_andnot(mask, b));
+}
+
+static inline vf vf_exp(vf v) {
+	vf x = vf_min(vf_max(v, vf_set1(VM_EXPF_MIN)), vf_set1(VM_EXPF_MAX));
+
+	// x = n * ln2 + r
+	vf nd = vf_add_magic(vf_mul(x, vf_set1(VM_LOG2EF)));
+	vf n = vf_sub(nd, vf_set1(VM_MAGICF));
+	vf r = vf_sub(vf_sub(x, vf_mul(n, vf_set1(VM_LN2_HIF))), vf_mul(n, vf_set1(VM_LN2_LOF)));
+
+	// e^r = 1 + r + r^2 * P(r)
+	vf p = vf_set1(1.9875691500e-4f);
+	p = vf_add(vf_mul(p, r), vf_set1(1.3981999507e-3f));
+	p = vf_add(vf_mul(p, r), vf_set1(8.3334519073e-3f));
+	p = vf_add(vf_mul(p, r), vf_set1(4.1665795894e-2f));
+	p = vf_add(vf_mul(p, r), vf_set1(1.6666665459e-1f));
+	p = vf_add(vf_mul(p, r), vf_set1(5.0000001201e-1f));
+	p = vf_add(vf_add(vf_mul(vf_mul(p, r), r), r), vf_set1(1.0f));
+
+	return vf_select(vf_isnan(v), v, vf_mul(p, vf_pow2n(nd)));
+}
+
+static inline vf vf_sigmoid(vf x) {
+	vf one = vf_set1(1.0f);
+	return vf_div(one, vf_add(one, vf_exp(vf_sub(vf_set1(0.0f), x))));
+}
+
+static inline vf vf_tanh(vf x) {
+	vf one = vf_set1(1.0f);
+	vf ax = vf_abs(x);
+
+	// large |x|: (1 - e) / (1 + e) with e = e^-2|x|
+	vf sign = vf_and(x, vf_set1(-0.0f));
+	vf e = vf_exp(vf_mul(ax, vf_set1(-2.0f)));
+	vf tl = vf_or(vf_div(vf_sub(one, e), vf_add(one, e)), sign);
+
+	// small |x| (< 0.625): tanh(x) = x + x * s * P(s), s = x^2
+	vf s2 = vf_mul(x, x);
+	vf p = vf_set1(-5.70498872745e-3f);
+	p = vf_add(vf_mul(p, s2), vf_set1(2.06390887954e-2f));
+	p = vf_add(vf_mul(p, s2), vf_set1(-5.37397155531e-2f));
+	p = vf_add(vf_mul(p, s2), vf_set1(1.33314422036e-1f));
+	p = vf_add(vf_mul(p, s2), vf_set1(-3.33332819422e-1f));
+	vf ts = vf_add(x, vf_mul(vf_mul(x, s2), p));
+
+	return vf_select(vf_cmplt(ax, vf_set1(0.625f)), ts, tl);
+}
+
+#define VM_ARRAY_KERNELF(name, f) \
+	void name(const float *v, float *r, int n) { \
+		int k = 0; \
+		for (; k + VF_LANES <= n; k += VF_LANES) { \
+			vf_store(r + k, f(vf_load(v + k))); \
+		} \
+		if (k < n) { \
+			float buf[VF_LANES] = {0}; \
+			memcpy(buf, v + k, (n - k) * sizeof(float)); \
+			vf_store(buf, f(vf_load(buf))); \
+			memcpy(r + k, buf, (n - k) * sizeof(float)); \
+		} \
+	}
+
+VM_ARRAY_KERNELF(expf_array, vf_exp)
+VM_ARRAY_KERNELF(sigmoidf_array, vf_sigmoid)
+VM_ARRAY_KERNELF(tanhf_array, vf_tanh)
+
+const char *vm_isa() {
+	return VD_ISA;
+}
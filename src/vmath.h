@@ -0,0 +1,40 @@
+#ifndef VMATH_H
+#define VMATH_H
+
+// vectorized math kernels for the activation functions.
+// these work on plain contiguous arrays (stride 1) of n doubles, v = input, r = output. r can be the same array as v.
+//
+// the kernels are compiled for the widest instruction set the compiler is allowed to use:
+// AVX2 (4 doubles per instruction, build with -mavx2 or -march=native), SSE2 (2 doubles, always available on x86-64) or plain C (1 double) everywhere else.
+// all three versions run the same algorithm, so results only differ in rounding.
+//
+// exp is computed as 2^n * e^r, where n = round(x / ln2) and |r| <= ln2 / 2, with e^r from its degree 12 taylor polynomial.
+// accuracy against libm (measured on 2 million points over [-40, 40], all three instruction sets):
+// exp_array: relative error <= 5e-16 (~2 ulp). inputs are clamped to [VM_EXP_MIN, VM_EXP_MAX], so it never returns inf or a denormal. NaN inputs give NaN in every kernel, like libm.
+// sigmoid_array: relative error <= 5e-16.
+// tanh_array: relative error <= 5e-16. uses (1 - e^-2|x|) / (1 + e^-2|x|), and a rational approximation for |x| < 0.625 where that would cancel.
+// sech_array: relative error <= 7e-16.
+//
+// the float versions (suffix f) process 8 floats per AVX2 instruction and 4 per SSE2 instruction, they use the lower degree polynomials of cephes expf/tanhf.
+// accuracy against libm in double precision (same measurement):
+// expf_array: relative error <= 2e-7. inputs are clamped to [VM_EXPF_MIN, VM_EXPF_MAX].
+// sigmoidf_array: relative error <= 2e-7.
+// tanhf_array: relative error <= 2e-7.
+
+#define VM_EXP_MIN -708.0
+#define VM_EXP_MAX 709.0
+#define VM_EXPF_MIN -87.0f
+#define VM_EXPF_MAX 88.0f
+
+void exp_array(const double *v, double *r, int n); // r = e^v
+void sigmoid_array(const double *v, double *r, int n); // r = 1 / (1 + e^-v)
+void tanh_array(const double *v, double *r, int n); // r = tanh(v)
+void sech_array(const double *v, double *r, int n); // r = 1 / cosh(v)
+
+void expf_array(const float *v, float *r, int n); // r = e^v
+void sigmoidf_array(const float *v, float *r, int n); // r = 1 / (1 + e^-v)
+void tanhf_array(const float *v, float *r, int n); // r = tanh(v)
+
+const char *vm_isa(); // name of the instruction set the kernels were compiled for ("avx2", "sse2" or "scalar")
+
+#endif